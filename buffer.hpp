@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <vector>
@@ -9,8 +10,8 @@ class Buffer
 {
     // std::unique_ptr<T> data;
     std::vector<T> data;
-    int width;
-    int height;
+    int width = 0;
+    int height = 0;
 
 public:
     Buffer() = default;
@@ -27,8 +28,23 @@ public:
         return data[getIndex(x, y)];
     }
 
+    const T &getElem(int x, int y) const
+    {
+        return data[x + y * width];
+    }
+
     void setElem(int x, int y, const T &value)
     {
         data[getIndex(x, y)] = value;
     }
+
+    void clear(const T &value)
+    {
+        std::fill(data.begin(), data.end(), value);
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    T *getData() { return data.data(); }
+    const T *getData() const { return data.data(); }
 };
\ No newline at end of file
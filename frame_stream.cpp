@@ -0,0 +1,130 @@
+#include "frame_stream.h"
+#include <cstring>
+#include <iostream>
+
+FrameStream::FrameStream(const std::string &path, FrameFormat _format, int _fps)
+    : format(_format), fps(_fps)
+{
+    if (path == "-")
+    {
+        out = stdout;
+    }
+    else
+    {
+        out = std::fopen(path.c_str(), "wb");
+        owned = true;
+    }
+    if (!out)
+        std::cerr << "can't open frame stream " << path << "\n";
+}
+
+FrameStream::~FrameStream()
+{
+    if (!out)
+        return;
+    if (owned)
+        std::fclose(out);
+    else
+        std::fflush(out);
+}
+
+// BT.601 limited range, 8 bit fixed point, specialized per bpp so that the loop vectorizes
+template <int BPP>
+static void rgbToYuv(const std::uint8_t *src, int count, std::uint8_t *y, std::uint8_t *u, std::uint8_t *v)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const int b = src[BPP * i], g = src[BPP * i + (BPP == 1 ? 0 : 1)], r = src[BPP * i + (BPP == 1 ? 0 : 2)];
+        y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+}
+
+static void rgbToYuv(const std::uint8_t *src, int bpp, int count, std::uint8_t *y, std::uint8_t *u, std::uint8_t *v)
+{
+    if (bpp == TGAImage::GRAYSCALE)
+        rgbToYuv<TGAImage::GRAYSCALE>(src, count, y, u, v);
+    else if (bpp == TGAImage::RGB)
+        rgbToYuv<TGAImage::RGB>(src, count, y, u, v);
+    else
+        rgbToYuv<TGAImage::RGBA>(src, count, y, u, v);
+}
+
+bool FrameStream::write(const TGAImage &frame, bool vflip)
+{
+    if (!out)
+        return false;
+    const int w = frame.width(), h = frame.height(), bpp = frame.bytespp();
+    if (frames == 0)
+    {
+        width = w;
+        height = h;
+        std::string header;
+        if (format == FrameFormat::PPM)
+        {
+            header = "P6\n" + std::to_string(w) + " " + std::to_string(h) + "\n255\n";
+        }
+        else if (format == FrameFormat::Y4M)
+        {
+            const std::string stream_header = "YUV4MPEG2 W" + std::to_string(w) + " H" + std::to_string(h) + " F" +
+                                              std::to_string(fps) + ":1 Ip A1:1 C444\n";
+            std::fwrite(stream_header.data(), 1, stream_header.size(), out);
+            header = "FRAME\n";
+        }
+        prefix = header.size();
+        buffer.resize(prefix + std::size_t(w) * h * 3);
+        std::memcpy(buffer.data(), header.data(), prefix);
+    }
+    else if (w != width || h != height)
+    {
+        std::cerr << "frame size changed from " << width << "x" << height << " to " << w << "x" << h << "\n";
+        return false;
+    }
+    // rows go out top-down, converted straight from the image into the frame buffer
+    std::uint8_t *dst = buffer.data() + prefix;
+    const std::size_t plane = std::size_t(w) * h;
+    for (int j = 0; j < h; j++)
+    {
+        const std::uint8_t *src = frame.row(vflip ? h - 1 - j : j);
+        if (format == FrameFormat::Y4M)
+        {
+            std::uint8_t *y = dst + std::size_t(j) * w;
+            rgbToYuv(src, bpp, w, y, y + plane, y + 2 * plane);
+        }
+        else if (bpp == TGAImage::RGB)
+        {
+            swizzleBGR(src, w, dst + std::size_t(j) * w * 3, simd_level);
+        }
+        else
+        {
+            std::uint8_t *rgb = dst + std::size_t(j) * w * 3;
+            for (int i = 0; i < w; i++, src += bpp, rgb += 3)
+            {
+                rgb[0] = src[bpp == 1 ? 0 : 2];
+                rgb[1] = src[bpp == 1 ? 0 : 1];
+                rgb[2] = src[0];
+            }
+        }
+    }
+    if (std::fwrite(buffer.data(), 1, buffer.size(), out) != buffer.size())
+    {
+        std::cerr << "can't write to the frame stream\n";
+        return false;
+    }
+    frames++;
+    return true;
+}
+
+bool parseFrameFormat(const std::string &name, FrameFormat &format)
+{
+    if (name == "raw")
+        format = FrameFormat::RAW_RGB;
+    else if (name == "ppm")
+        format = FrameFormat::PPM;
+    else if (name == "y4m")
+        format = FrameFormat::Y4M;
+    else
+        return false;
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "tgaimage.h"
+#include "rasterizer.h"
+
+enum class FrameFormat
+{
+    // bare 8 bit rgb, the reader has to be told the size, e.g. ffmpeg -f rawvideo -pixel_format rgb24
+    RAW_RGB,
+    // a binary P6 header before every frame, readable as a stream of images (ffmpeg -f image2pipe)
+    PPM,
+    // YUV4MPEG2 with 4:4:4 BT.601 limited range planes, the header carries size and frame rate
+    Y4M
+};
+
+// successive frames written to stdout or a named pipe, so that a video encoder can consume them without temp files
+// the frame buffer is allocated on the first frame and reused, pixels are converted once straight into it
+class FrameStream
+{
+public:
+    // "-" is stdout, any other path is opened for writing, a fifo made with mkfifo blocks until the reader opens it
+    FrameStream(const std::string &path, FrameFormat format, int fps = 30);
+    ~FrameStream();
+    FrameStream(const FrameStream &) = delete;
+    FrameStream &operator=(const FrameStream &) = delete;
+
+    bool isOpen() const { return out != nullptr; }
+    // all frames of a stream must have the same size, vflip puts row 0 at the bottom like write_tga_file
+    bool write(const TGAImage &frame, bool vflip = true);
+    int framesWritten() const { return frames; }
+
+private:
+    FILE *out = nullptr;
+    bool owned = false;
+    FrameFormat format;
+    int fps;
+    int width = 0, height = 0;
+    int frames = 0;
+    SimdLevel simd_level = detectSimdLevel();
+    // what comes before the pixels of every frame, the PPM header or the Y4M FRAME marker
+    std::size_t prefix = 0;
+    std::vector<std::uint8_t> buffer;
+};
+
+// "raw", "ppm" or "y4m", false for anything else
+bool parseFrameFormat(const std::string &name, FrameFormat &format);
@@ -1,143 +1,169 @@
 #pragma once
 #include <cmath>
 #include <cassert>
+#include <cstddef>
 #include <iostream>
+#include <type_traits>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SERIKA_SSE
+#endif
+
+// scalar type of vec3, mat4, ... switched with the SERIKA_USE_FLOAT build option
+#ifdef SERIKA_USE_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
+// keeps T out of template argument deduction, so that vec<3, float> * 2. still compiles
+template <typename T>
+struct non_deduced
+{
+    typedef T type;
+};
+template <typename T>
+using non_deduced_t = typename non_deduced<T>::type;
 
-template <int n>
-struct vec
+// float vec4 (and the padded vec3) are 16 byte aligned so that they can be loaded into one sse register
+template <int n, typename T>
+constexpr std::size_t vec_align = (std::is_same<T, float>::value && (n == 3 || n == 4)) ? 16 : alignof(T);
+
+template <int n, typename T = real>
+struct alignas(vec_align<n, T>) vec
 {
-    double data[n] = {0};
-    double &operator[](const int i)
+    T data[n] = {0};
+    T &operator[](const int i)
     {
         assert(i >= 0 && i < n);
         return data[i];
     }
-    double operator[](const int i) const
+    T operator[](const int i) const
     {
         assert(i >= 0 && i < n);
         return data[i];
     }
-    double norm2() const { return *this * *this; }
-    double norm() const { return std::sqrt(norm2()); }
+    T norm2() const { return *this * *this; }
+    T norm() const { return std::sqrt(norm2()); }
 };
 
-template <int n>
-double operator*(const vec<n> &lhs, const vec<n> &rhs)
+template <int n, typename T>
+T operator*(const vec<n, T> &lhs, const vec<n, T> &rhs)
 {
-    double ret = 0;
+    T ret = 0;
     for (int i = n; i--; ret += lhs[i] * rhs[i])
         ;
     return ret;
 }
 
-template <int n>
-vec<n> operator+(const vec<n> &lhs, const vec<n> &rhs)
+template <int n, typename T>
+vec<n, T> operator+(const vec<n, T> &lhs, const vec<n, T> &rhs)
 {
-    vec<n> ret = lhs;
+    vec<n, T> ret = lhs;
     for (int i = n; i--; ret[i] += rhs[i])
         ;
     return ret;
 }
 
-template <int n>
-vec<n> operator-(const vec<n> &lhs, const vec<n> &rhs)
+template <int n, typename T>
+vec<n, T> operator-(const vec<n, T> &lhs, const vec<n, T> &rhs)
 {
-    vec<n> ret = lhs;
+    vec<n, T> ret = lhs;
     for (int i = n; i--; ret[i] -= rhs[i])
         ;
     return ret;
 }
 
-template <int n>
-vec<n> operator*(const double &rhs, const vec<n> &lhs)
+template <int n, typename T>
+vec<n, T> operator*(const non_deduced_t<T> &rhs, const vec<n, T> &lhs)
 {
-    vec<n> ret = lhs;
+    vec<n, T> ret = lhs;
     for (int i = n; i--; ret[i] *= rhs)
         ;
     return ret;
 }
 
-template <int n>
-vec<n> operator*(const vec<n> &lhs, const double &rhs)
+template <int n, typename T>
+vec<n, T> operator*(const vec<n, T> &lhs, const non_deduced_t<T> &rhs)
 {
-    vec<n> ret = lhs;
+    vec<n, T> ret = lhs;
     for (int i = n; i--; ret[i] *= rhs)
         ;
     return ret;
 }
 
-template <int n>
-vec<n> operator/(const vec<n> &lhs, const double &rhs)
+template <int n, typename T>
+vec<n, T> operator/(const vec<n, T> &lhs, const non_deduced_t<T> &rhs)
 {
-    vec<n> ret = lhs;
+    vec<n, T> ret = lhs;
     for (int i = n; i--; ret[i] /= rhs)
         ;
     return ret;
 }
 
-template <int n1, int n2>
-vec<n1> embed(const vec<n2> &v, double fill = 1)
+template <int n1, int n2, typename T>
+vec<n1, T> embed(const vec<n2, T> &v, non_deduced_t<T> fill = 1)
 {
-    vec<n1> ret;
+    vec<n1, T> ret;
     for (int i = n1; i--; ret[i] = (i < n2 ? v[i] : fill))
         ;
     return ret;
 }
 
-template <int n1, int n2>
-vec<n1> proj(const vec<n2> &v)
+template <int n1, int n2, typename T>
+vec<n1, T> proj(const vec<n2, T> &v)
 {
-    vec<n1> ret;
+    vec<n1, T> ret;
     for (int i = n1; i--; ret[i] = v[i])
         ;
     return ret;
 }
 
-template <int n>
-std::ostream &operator<<(std::ostream &out, const vec<n> &v)
+template <int n, typename T>
+std::ostream &operator<<(std::ostream &out, const vec<n, T> &v)
 {
     for (int i = 0; i < n; i++)
         out << v[i] << " ";
     return out;
 }
 
-template <>
-struct vec<2>
+template <typename T>
+struct vec<2, T>
 {
-    double x = 0, y = 0;
-    double &operator[](const int i)
+    T x = 0, y = 0;
+    T &operator[](const int i)
     {
         assert(i >= 0 && i < 2);
         return i ? y : x;
     }
-    double operator[](const int i) const
+    T operator[](const int i) const
     {
         assert(i >= 0 && i < 2);
         return i ? y : x;
     }
-    double norm2() const { return *this * *this; }
-    double norm() const { return std::sqrt(norm2()); }
-    vec<2> normalized() { return (*this) / norm(); }
+    T norm2() const { return *this * *this; }
+    T norm() const { return std::sqrt(norm2()); }
+    vec<2, T> normalized() { return (*this) / norm(); }
 };
 
-template <>
-struct vec<3>
+template <typename T>
+struct alignas(vec_align<3, T>) vec<3, T>
 {
-    double x = 0, y = 0, z = 0;
-    double &operator[](const int i)
+    T x = 0, y = 0, z = 0;
+    T &operator[](const int i)
     {
         assert(i >= 0 && i < 3);
         return i ? (1 == i ? y : z) : x;
     }
-    double operator[](const int i) const
+    T operator[](const int i) const
     {
         assert(i >= 0 && i < 3);
         return i ? (1 == i ? y : z) : x;
     }
-    double norm2() const { return *this * *this; }
-    double norm() const { return std::sqrt(norm2()); }
-    vec<3> normalized() const { return (*this) / norm(); }
-    vec(const double &_x, const double &_y, const double &_z)
+    T norm2() const { return *this * *this; }
+    T norm() const { return std::sqrt(norm2()); }
+    vec<3, T> normalized() const { return (*this) / norm(); }
+    vec(const T &_x, const T &_y, const T &_z)
         : x(_x), y(_y), z(_z) {}
     vec() = default;
 };
@@ -145,182 +171,215 @@ struct vec<3>
 typedef vec<2> vec2;
 typedef vec<3> vec3;
 typedef vec<4> vec4;
-vec3 cross(const vec3 &v1, const vec3 &v2);
-vec3 operator^(const vec3 &v1, const vec3 &v2);
+typedef vec<3, float> vec3f;
+typedef vec<4, float> vec4f;
+
+template <typename T>
+vec<3, T> cross(const vec<3, T> &v1, const vec<3, T> &v2)
+{
+    return vec<3, T>{v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x};
+}
 
-template <int n>
+template <typename T>
+vec<3, T> operator^(const vec<3, T> &v1, const vec<3, T> &v2)
+{
+    return cross(v1, v2);
+}
+
+template <int n, typename T>
 struct dt;
 
-template <int nrows, int ncols>
+template <int nrows, int ncols, typename T = real>
 struct mat
 {
-    vec<ncols> rows[nrows] = {{}};
+    vec<ncols, T> rows[nrows] = {{}};
 
-    vec<ncols> &operator[](const int idx)
+    vec<ncols, T> &operator[](const int idx)
     {
         assert(idx >= 0 && idx < nrows);
         return rows[idx];
     }
-    const vec<ncols> &operator[](const int idx) const
+    const vec<ncols, T> &operator[](const int idx) const
     {
         assert(idx >= 0 && idx < nrows);
         return rows[idx];
     }
 
-    vec<nrows> col(const int idx) const
+    vec<nrows, T> col(const int idx) const
     {
         assert(idx >= 0 && idx < ncols);
-        vec<nrows> ret;
+        vec<nrows, T> ret;
         for (int i = nrows; i--; ret[i] = rows[i][idx])
             ;
         return ret;
     }
 
-    void set_col(const int idx, const vec<nrows> &v)
+    void set_col(const int idx, const vec<nrows, T> &v)
     {
         assert(idx >= 0 && idx < ncols);
         for (int i = nrows; i--; rows[i][idx] = v[i])
             ;
     }
 
-    static mat<nrows, ncols> identity()
+    static mat<nrows, ncols, T> identity()
     {
-        mat<nrows, ncols> ret;
+        mat<nrows, ncols, T> ret;
         for (int i = nrows; i--;)
             for (int j = ncols; j--; ret[i][j] = (i == j))
                 ;
         return ret;
     }
 
-    double det() const
+    T det() const
     {
-        return dt<ncols>::det(*this);
+        return dt<ncols, T>::det(*this);
     }
 
-    mat<nrows - 1, ncols - 1> get_minor(const int row, const int col) const
+    mat<nrows - 1, ncols - 1, T> get_minor(const int row, const int col) const
     {
-        mat<nrows - 1, ncols - 1> ret;
+        mat<nrows - 1, ncols - 1, T> ret;
         for (int i = nrows - 1; i--;)
             for (int j = ncols - 1; j--; ret[i][j] = rows[i < row ? i : i + 1][j < col ? j : j + 1])
                 ;
         return ret;
     }
 
-    double cofactor(const int row, const int col) const
+    T cofactor(const int row, const int col) const
     {
         return get_minor(row, col).det() * ((row + col) % 2 ? -1 : 1);
     }
 
-    mat<nrows, ncols> adjugate() const
+    mat<nrows, ncols, T> adjugate() const
     {
-        mat<nrows, ncols> ret;
+        mat<nrows, ncols, T> ret;
         for (int i = nrows; i--;)
             for (int j = ncols; j--; ret[i][j] = cofactor(i, j))
                 ;
         return ret;
     }
 
-    mat<nrows, ncols> invert_transpose() const
+    mat<nrows, ncols, T> invert_transpose() const
     {
-        mat<nrows, ncols> ret = adjugate();
+        mat<nrows, ncols, T> ret = adjugate();
         return ret / (ret[0] * rows[0]);
     }
 
-    mat<nrows, ncols> invert() const
+    mat<nrows, ncols, T> invert() const
     {
         return invert_transpose().transpose();
     }
 
-    mat<ncols, nrows> transpose() const
+    mat<ncols, nrows, T> transpose() const
     {
-        mat<ncols, nrows> ret;
+        mat<ncols, nrows, T> ret;
         for (int i = ncols; i--; ret[i] = this->col(i))
             ;
         return ret;
     }
+
+    // conversion between the float and double families
+    template <typename U>
+    mat<nrows, ncols, U> cast() const
+    {
+        mat<nrows, ncols, U> ret;
+        for (int i = nrows; i--;)
+            for (int j = ncols; j--; ret[i][j] = U(rows[i][j]))
+                ;
+        return ret;
+    }
 };
 
-template <int nrows, int ncols>
-vec<nrows> operator*(const mat<nrows, ncols> &lhs, const vec<ncols> &rhs)
+template <int nrows, int ncols, typename T>
+vec<nrows, T> operator*(const mat<nrows, ncols, T> &lhs, const vec<ncols, T> &rhs)
 {
-    vec<nrows> ret;
+    vec<nrows, T> ret;
     for (int i = nrows; i--; ret[i] = lhs[i] * rhs)
         ;
     return ret;
 }
 
-template <int R1, int C1, int C2>
-mat<R1, C2> operator*(const mat<R1, C1> &lhs, const mat<C1, C2> &rhs)
+template <int R1, int C1, int C2, typename T>
+mat<R1, C2, T> operator*(const mat<R1, C1, T> &lhs, const mat<C1, C2, T> &rhs)
 {
-    mat<R1, C2> result;
+    mat<R1, C2, T> result;
     for (int i = R1; i--;)
         for (int j = C2; j--; result[i][j] = lhs[i] * rhs.col(j))
             ;
     return result;
 }
 
-template <int nrows, int ncols>
-mat<nrows, ncols> operator*(const mat<nrows, ncols> &lhs, const double &val)
+template <int nrows, int ncols, typename T>
+mat<nrows, ncols, T> operator*(const mat<nrows, ncols, T> &lhs, const non_deduced_t<T> &val)
 {
-    mat<nrows, ncols> result;
+    mat<nrows, ncols, T> result;
     for (int i = nrows; i--; result[i] = lhs[i] * val)
         ;
     return result;
 }
 
-template <int nrows, int ncols>
-mat<nrows, ncols> operator/(const mat<nrows, ncols> &lhs, const double &val)
+template <int nrows, int ncols, typename T>
+mat<nrows, ncols, T> operator/(const mat<nrows, ncols, T> &lhs, const non_deduced_t<T> &val)
 {
-    mat<nrows, ncols> result;
+    mat<nrows, ncols, T> result;
     for (int i = nrows; i--; result[i] = lhs[i] / val)
         ;
     return result;
 }
 
-template <int nrows, int ncols>
-mat<nrows, ncols> operator+(const mat<nrows, ncols> &lhs, const mat<nrows, ncols> &rhs)
+template <int nrows, int ncols, typename T>
+mat<nrows, ncols, T> operator+(const mat<nrows, ncols, T> &lhs, const mat<nrows, ncols, T> &rhs)
 {
-    mat<nrows, ncols> result;
+    mat<nrows, ncols, T> result;
     for (int i = nrows; i--;)
         for (int j = ncols; j--; result[i][j] = lhs[i][j] + rhs[i][j])
             ;
     return result;
 }
 
-template <int nrows, int ncols>
-mat<nrows, ncols> operator-(const mat<nrows, ncols> &lhs, const mat<nrows, ncols> &rhs)
+template <int nrows, int ncols, typename T>
+mat<nrows, ncols, T> operator-(const mat<nrows, ncols, T> &lhs, const mat<nrows, ncols, T> &rhs)
 {
-    mat<nrows, ncols> result;
+    mat<nrows, ncols, T> result;
     for (int i = nrows; i--;)
         for (int j = ncols; j--; result[i][j] = lhs[i][j] - rhs[i][j])
             ;
     return result;
 }
 
-template <int nrows, int ncols>
-std::ostream &operator<<(std::ostream &out, const mat<nrows, ncols> &m)
+template <int nrows, int ncols, typename T>
+bool operator==(const mat<nrows, ncols, T> &lhs, const mat<nrows, ncols, T> &rhs)
+{
+    for (int i = nrows; i--;)
+        for (int j = ncols; j--;)
+            if (lhs[i][j] != rhs[i][j])
+                return false;
+    return true;
+}
+
+template <int nrows, int ncols, typename T>
+std::ostream &operator<<(std::ostream &out, const mat<nrows, ncols, T> &m)
 {
     for (int i = 0; i < nrows; i++)
         out << m[i] << std::endl;
     return out;
 }
 
-template <int n>
+template <int n, typename T>
 struct dt
 {
-    static double det(const mat<n, n> &src)
+    static T det(const mat<n, n, T> &src)
     {
-        double ret = 0;
+        T ret = 0;
         for (int i = n; i--; ret += src[0][i] * src.cofactor(0, i))
             ;
         return ret;
     }
 };
 
-template <>
-struct dt<1>
+template <typename T>
+struct dt<1, T>
 {
-    static double det(const mat<1, 1> &src)
+    static T det(const mat<1, 1, T> &src)
     {
         return src[0][0];
     }
@@ -329,6 +388,105 @@ struct dt<1>
 typedef mat<4, 4> mat4;
 typedef mat<3, 3> mat3;
 typedef mat<2, 2> mat2;
+typedef mat<4, 4, float> mat4f;
+
+// transforms count points (w = 1) into homogeneous coordinates
+template <typename T>
+void transform_points(const mat<4, 4, T> &m, const vec<3, T> *in, vec<4, T> *out, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; i++)
+        out[i] = m * embed<4>(in[i], 1);
+}
+
+#ifdef SERIKA_SSE
+// sse versions for the float family, picked over the templates above by overload resolution
+inline __m128 load_ps(const vec4f &v) { return _mm_load_ps(v.data); }
+inline __m128 load_ps(const vec3f &v) { return _mm_setr_ps(v.x, v.y, v.z, 0.0f); }
+
+inline float hsum_ps(__m128 v)
+{
+    __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+inline float operator*(const vec4f &lhs, const vec4f &rhs)
+{
+    return hsum_ps(_mm_mul_ps(load_ps(lhs), load_ps(rhs)));
+}
+
+inline float operator*(const vec3f &lhs, const vec3f &rhs)
+{
+    return hsum_ps(_mm_mul_ps(load_ps(lhs), load_ps(rhs)));
+}
+
+inline vec3f cross(const vec3f &v1, const vec3f &v2)
+{
+    __m128 a = load_ps(v1), b = load_ps(v2);
+    __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+    c = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+    alignas(16) float r[4];
+    _mm_store_ps(r, c);
+    return {r[0], r[1], r[2]};
+}
+
+inline vec3f operator^(const vec3f &v1, const vec3f &v2)
+{
+    return cross(v1, v2);
+}
+
+// columns of m scaled by the components of v and summed, no horizontal adds
+inline __m128 mul_ps(const mat4f &m, __m128 v)
+{
+    __m128 r0 = load_ps(m[0]), r1 = load_ps(m[1]), r2 = load_ps(m[2]), r3 = load_ps(m[3]);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    __m128 ret = _mm_mul_ps(r0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)));
+    ret = _mm_add_ps(ret, _mm_mul_ps(r1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))));
+    ret = _mm_add_ps(ret, _mm_mul_ps(r2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+    ret = _mm_add_ps(ret, _mm_mul_ps(r3, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))));
+    return ret;
+}
+
+inline vec4f operator*(const mat4f &lhs, const vec4f &rhs)
+{
+    vec4f ret;
+    _mm_store_ps(ret.data, mul_ps(lhs, load_ps(rhs)));
+    return ret;
+}
+
+inline mat4f operator*(const mat4f &lhs, const mat4f &rhs)
+{
+    // row i of the product = sum_k lhs[i][k] * rhs[k]
+    __m128 b[4] = {load_ps(rhs[0]), load_ps(rhs[1]), load_ps(rhs[2]), load_ps(rhs[3])};
+    mat4f ret;
+    for (int i = 0; i < 4; i++)
+    {
+        __m128 r = _mm_mul_ps(_mm_set1_ps(lhs[i][0]), b[0]);
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(lhs[i][1]), b[1]));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(lhs[i][2]), b[2]));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(lhs[i][3]), b[3]));
+        _mm_store_ps(ret[i].data, r);
+    }
+    return ret;
+}
+
+inline void transform_points(const mat4f &m, const vec3f *in, vec4f *out, std::size_t count)
+{
+    // the transposed matrix stays in registers for the whole batch
+    __m128 c0 = load_ps(m[0]), c1 = load_ps(m[1]), c2 = load_ps(m[2]), c3 = load_ps(m[3]);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    for (std::size_t i = 0; i < count; i++)
+    {
+        __m128 r = _mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(in[i].x)), c3);
+        r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(in[i].y)));
+        r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(in[i].z)));
+        _mm_store_ps(out[i].data, r);
+    }
+}
+#endif
 
 mat3 getCrossMat(const vec3 &v);
 mat4 getCrossMat4fromVec3(const vec3 &v);
@@ -3,6 +3,24 @@
 #include "renderer.h"
 #include "transforms.h"
 #include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+// time the frame writers on the rendered frame, frame dumps of long jobs are bound by these
+static void benchmarkOutput(Renderer &renderer, int frames)
+{
+    for (const char *path : {"bench_output.tga", "bench_output.qoi"})
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++)
+            renderer.write_tga_file(path);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << path << ": " << elapsed.count() / frames << " ms/frame, "
+                  << std::filesystem::file_size(path) << " bytes" << std::endl;
+    }
+}
 
 int main(int argc, char **argv)
 {
@@ -28,7 +46,30 @@ int main(int argc, char **argv)
 
     // render faces
     renderer.render(scene);
+    // --stats: culling and hierarchical-z counters of the frame
+    if (argc > 1 && std::string(argv[1]) == "--stats")
+    {
+        auto &stats = renderer.getStats();
+        std::cerr << "culled: backface " << stats.triangles_backface_culled << " frustum " << stats.triangles_frustum_culled
+                  << " clipped " << stats.triangles_clipped << std::endl;
+        std::cerr << "hiz: triangles " << stats.triangles_rejected << "/" << stats.triangles_tested
+                  << " blocks " << stats.blocks_rejected << "/" << stats.blocks_tested << " rejected" << std::endl;
+    }
     renderer.write_tga_file("face_width_mvp.tga");
 
+    // --stream <path or - for stdout> [raw|ppm|y4m], e.g. | ffmpeg -f yuv4mpegpipe -i - out.mp4
+    if (argc > 2 && std::string(argv[1]) == "--stream")
+    {
+        FrameFormat format = FrameFormat::Y4M;
+        if (argc > 3 && !parseFrameFormat(argv[3], format))
+            std::cerr << "unknown frame format " << argv[3] << ", using y4m" << std::endl;
+        FrameStream stream(argv[2], format);
+        renderer.write_frame(stream);
+    }
+
+    // --bench-output [frames]
+    if (argc > 1 && std::string(argv[1]) == "--bench-output")
+        benchmarkOutput(renderer, argc > 2 ? std::max(1, std::atoi(argv[2])) : 100);
+
     return 0;
 }
\ No newline at end of file
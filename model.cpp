@@ -62,9 +62,9 @@ Model::Model(const std::string filename)
         }
     }
     std::cerr << "# v# " << nverts() << " f# " << nfaces() << " vt# " << tex_coord.size() << " vn# " << norms.size() << std::endl;
-    load_texture(filename, "_diffuse.tga", diffusemap);
-    load_texture(filename, "_nm_tangent.tga", normalmap);
-    load_texture(filename, "_spec.tga", specularmap);
+    load_texture(filename, "_diffuse.tga", TextureFormat::COLOR, diffusemap);
+    load_texture(filename, "_nm_tangent.tga", TextureFormat::NORMAL, normalmap);
+    load_texture(filename, "_spec.tga", TextureFormat::COLOR, specularmap);
 }
 
 int Model::nverts() const
@@ -87,19 +87,17 @@ vec3 Model::vert(const int iface, const int nthvert) const
     return verts[facet_vrt[iface * 3 + nthvert]];
 }
 
-void Model::load_texture(std::string filename, const std::string suffix, TGAImage &img)
+void Model::load_texture(std::string filename, const std::string suffix, TextureFormat format, TextureHandle &texture)
 {
     size_t dot = filename.find_last_of(".");
     if (dot == std::string::npos)
         return;
-    std::string texfile = filename.substr(0, dot) + suffix;
-    std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
+    texture = TexturePool::instance().load(filename.substr(0, dot) + suffix, format);
 }
 
 vec3 Model::normal(const vec2 &uvf) const
 {
-    TGAColor c = normalmap.get(uvf[0] * normalmap.width(), uvf[1] * normalmap.height());
-    return vec3{(double)c[2], (double)c[1], (double)c[0]} * 2. / 255. - vec3{1, 1, 1};
+    return normalmap->sampleNormal({uvf}, TextureFilter::NEAREST);
 }
 
 vec2 Model::uv(const int iface, const int nthvert) const
@@ -3,6 +3,7 @@
 #include <string>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture_pool.h"
 
 class Model
 {
@@ -12,10 +13,11 @@ class Model
     std::vector<int> facet_vrt{};
     std::vector<int> facet_tex{}; // per-triangle indices in the above arrays
     std::vector<int> facet_nrm{};
-    TGAImage diffusemap{};  // diffuse color texture
-    TGAImage normalmap{};   // normal map texture
-    TGAImage specularmap{}; // specular map texture
-    void load_texture(const std::string filename, const std::string suffix, TGAImage &img);
+    // shared through TexturePool, never null
+    TextureHandle diffusemap = std::make_shared<const Texture>();  // diffuse color texture
+    TextureHandle normalmap = std::make_shared<const Texture>();   // normal map texture
+    TextureHandle specularmap = std::make_shared<const Texture>(); // specular map texture
+    void load_texture(const std::string filename, const std::string suffix, TextureFormat format, TextureHandle &texture);
 
 public:
     friend class Mesh;
@@ -23,10 +25,11 @@ public:
     int nverts() const;
     int nfaces() const;
     vec3 normal(const int iface, const int nthvert) const; // per triangle corner normal vertex
-    vec3 normal(const vec2 &uv) const;                     // fetch the normal vector from the normal map texture
+    vec3 normal(const vec2 &uv) const;                     // fetch the unit normal vector from the normal map texture
     vec3 vert(const int i) const;
     vec3 vert(const int iface, const int nthvert) const;
     vec2 uv(const int iface, const int nthvert) const;
-    const TGAImage &diffuse() const { return diffusemap; }
-    const TGAImage &specular() const { return specularmap; }
+    const TextureHandle &diffuse() const { return diffusemap; }
+    const TextureHandle &normalMap() const { return normalmap; }
+    const TextureHandle &specular() const { return specularmap; }
 };
@@ -0,0 +1,663 @@
+#include "rasterizer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SERIKA_X86
+#endif
+
+SimdLevel detectSimdLevel()
+{
+#ifdef SERIKA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return SimdLevel::SSE;
+#endif
+    return SimdLevel::SCALAR;
+}
+
+const SamplePattern &getSamplePattern(int count)
+{
+    static const SamplePattern patterns[4] = {
+        {1, {{0, 0}}},
+        {2, {{4, 4}, {-4, -4}}},
+        {4, {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}}},
+        {8, {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}}}};
+    int i = count >= 8 ? 3 : count >= 4 ? 2 : count >= 2 ? 1 : 0;
+    return patterns[i];
+}
+
+bool EdgeFunctions::setup(const vec3 *pts)
+{
+    std::int64_t X[3], Y[3];
+    for (int i = 0; i < 3; i++)
+    {
+        // 同时排除了NaN
+        if (!(std::abs(pts[i].x) < GUARD_BAND && std::abs(pts[i].y) < GUARD_BAND))
+            return false;
+        X[i] = std::llround(pts[i].x * SUBPIXEL_ONE);
+        Y[i] = std::llround(pts[i].y * SUBPIXEL_ONE);
+    }
+
+    std::int64_t area = (X[1] - X[0]) * (Y[2] - Y[0]) - (Y[1] - Y[0]) * (X[2] - X[0]);
+    if (area == 0)
+        return false;
+    // 两种绕序都光栅化，翻转使内部为正
+    std::int64_t sign = area > 0 ? 1 : -1;
+    inv_area = 1.0 / double(area * sign);
+
+    for (int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3, k = (i + 2) % 3;
+        // w_i(P) = (Xk - Xj) * (Py - Yj) - (Yk - Yj) * (Px - Xj), P on the sub-pixel grid
+        std::int64_t a = -(Y[k] - Y[j]) * sign;
+        std::int64_t b = (X[k] - X[j]) * sign;
+        std::int64_t c = -a * X[j] - b * Y[j];
+        // top-left rule: pixels exactly on an edge belong to the triangle only if the edge is a left or top edge
+        bool top_left = a > 0 || (a == 0 && b > 0);
+        bias[i] = top_left ? 0 : 1;
+        A[i] = a * SUBPIXEL_ONE;
+        B[i] = b * SUBPIXEL_ONE;
+        C[i] = c - bias[i];
+    }
+
+    Plane z = plane(pts[0].z, pts[1].z, pts[2].z);
+    Zx = z.dx;
+    Zy = z.dy;
+    Zc = z.c;
+    return true;
+}
+
+// 所有实现都按 zrow + dzdx * dx 的顺序做float运算，保证和标量路径逐位一致
+static float blockDepth(const EdgeFunctions &ef, int ox, int oy)
+{
+    return ef.Zx * ox + ef.Zy * oy + ef.Zc;
+}
+
+// depth row of the block, partial rows are copied so that no pixel outside the buffer is read
+static const float *depthRow(const float *depth, std::uint8_t colmask, float *tmp)
+{
+    if (colmask == 0xFF)
+        return depth;
+    for (int dx = 0; dx < BLOCK_SIZE; dx++)
+        tmp[dx] = (colmask >> dx) & 1 ? depth[dx] : 0.0f;
+    return tmp;
+}
+
+static std::uint64_t rasterizeBlockScalar(const EdgeFunctions &ef, int ox, int oy, std::uint8_t colmask, int row_begin, int row_end,
+                                          const float *depth, int depth_stride, float *z)
+{
+    std::uint64_t mask = 0;
+    float z0 = blockDepth(ef, ox, oy), dzdx = ef.Zx, dzdy = ef.Zy;
+    std::int64_t w_row[3];
+    for (int i = 0; i < 3; i++)
+        w_row[i] = ef.at(i, ox, oy) + ef.stepY(i) * row_begin;
+    for (int dy = row_begin; dy <= row_end; dy++)
+    {
+        float zrow = z0 + dzdy * float(dy);
+        std::int64_t w[3] = {w_row[0], w_row[1], w_row[2]};
+        for (int dx = 0; dx < BLOCK_SIZE; dx++)
+        {
+            if ((colmask >> dx) & 1 && (w[0] | w[1] | w[2]) >= 0)
+            {
+                float zp = zrow + dzdx * float(dx);
+                z[dx + dy * BLOCK_SIZE] = zp;
+                if (!depth || zp < depth[dx + dy * depth_stride])
+                    mask |= std::uint64_t(1) << (dx + dy * BLOCK_SIZE);
+            }
+            for (int i = 0; i < 3; i++)
+                w[i] += ef.stepX(i);
+        }
+        for (int i = 0; i < 3; i++)
+            w_row[i] += ef.stepY(i);
+    }
+    return mask;
+}
+
+#ifdef SERIKA_X86
+__attribute__((target("sse4.2"))) static std::uint64_t rasterizeBlockSSE(const EdgeFunctions &ef, int ox, int oy, std::uint8_t colmask, int row_begin, int row_end,
+                                                                         const float *depth, int depth_stride, float *z)
+{
+    std::uint64_t mask = 0;
+    float z0 = blockDepth(ef, ox, oy), dzdx = ef.Zx, dzdy = ef.Zy;
+    const __m128 lanes[2] = {_mm_setr_ps(0, 1, 2, 3), _mm_setr_ps(4, 5, 6, 7)};
+    const __m128 vdzdx = _mm_set1_ps(dzdx);
+    // 2 lanes of 64 bit edge values per register, 4 registers per block row
+    __m128i step[3][4];
+    std::int64_t w_row[3];
+    for (int i = 0; i < 3; i++)
+    {
+        std::int64_t a = ef.stepX(i);
+        for (int k = 0; k < 4; k++)
+            step[i][k] = _mm_set_epi64x(a * (2 * k + 1), a * (2 * k));
+        w_row[i] = ef.at(i, ox, oy) + ef.stepY(i) * row_begin;
+    }
+    for (int dy = row_begin; dy <= row_end; dy++)
+    {
+        __m128i outside[4] = {};
+        for (int i = 0; i < 3; i++)
+        {
+            __m128i row = _mm_set1_epi64x(w_row[i]);
+            for (int k = 0; k < 4; k++)
+                outside[k] = _mm_or_si128(outside[k], _mm_add_epi64(row, step[i][k]));
+            w_row[i] += ef.stepY(i);
+        }
+        // a pixel is covered if none of its edge values has the sign bit set
+        int covered = 0;
+        for (int k = 0; k < 4; k++)
+            covered |= _mm_movemask_pd(_mm_castsi128_pd(outside[k])) << (2 * k);
+        covered = ~covered & colmask;
+        if (!covered)
+            continue;
+
+        __m128 zrow = _mm_set1_ps(z0 + dzdy * float(dy));
+        float tmp[BLOCK_SIZE];
+        const float *drow = depth ? depthRow(depth + dy * depth_stride, colmask, tmp) : nullptr;
+        for (int k = 0; k < 2; k++)
+        {
+            __m128 zp = _mm_add_ps(zrow, _mm_mul_ps(vdzdx, lanes[k]));
+            _mm_storeu_ps(z + dy * BLOCK_SIZE + 4 * k, zp);
+            if (drow)
+            {
+                int pass = _mm_movemask_ps(_mm_cmplt_ps(zp, _mm_loadu_ps(drow + 4 * k)));
+                covered &= ~((~pass & 0xF) << (4 * k));
+            }
+        }
+        mask |= std::uint64_t(covered) << (dy * BLOCK_SIZE);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2"))) static std::uint64_t rasterizeBlockAVX2(const EdgeFunctions &ef, int ox, int oy, std::uint8_t colmask, int row_begin, int row_end,
+                                                                        const float *depth, int depth_stride, float *z)
+{
+    std::uint64_t mask = 0;
+    float z0 = blockDepth(ef, ox, oy), dzdx = ef.Zx, dzdy = ef.Zy;
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 vdzdx = _mm256_set1_ps(dzdx);
+    // 4 lanes of 64 bit edge values per register, 2 registers per block row
+    __m256i step[3][2];
+    std::int64_t w_row[3];
+    for (int i = 0; i < 3; i++)
+    {
+        std::int64_t a = ef.stepX(i);
+        step[i][0] = _mm256_set_epi64x(3 * a, 2 * a, a, 0);
+        step[i][1] = _mm256_set_epi64x(7 * a, 6 * a, 5 * a, 4 * a);
+        w_row[i] = ef.at(i, ox, oy) + ef.stepY(i) * row_begin;
+    }
+    for (int dy = row_begin; dy <= row_end; dy++)
+    {
+        __m256i outside[2] = {_mm256_setzero_si256(), _mm256_setzero_si256()};
+        for (int i = 0; i < 3; i++)
+        {
+            __m256i row = _mm256_set1_epi64x(w_row[i]);
+            outside[0] = _mm256_or_si256(outside[0], _mm256_add_epi64(row, step[i][0]));
+            outside[1] = _mm256_or_si256(outside[1], _mm256_add_epi64(row, step[i][1]));
+            w_row[i] += ef.stepY(i);
+        }
+        int covered = _mm256_movemask_pd(_mm256_castsi256_pd(outside[0])) |
+                      _mm256_movemask_pd(_mm256_castsi256_pd(outside[1])) << 4;
+        covered = ~covered & colmask;
+        if (!covered)
+            continue;
+
+        __m256 zp = _mm256_add_ps(_mm256_set1_ps(z0 + dzdy * float(dy)), _mm256_mul_ps(vdzdx, lanes));
+        _mm256_storeu_ps(z + dy * BLOCK_SIZE, zp);
+        if (depth)
+        {
+            float tmp[BLOCK_SIZE];
+            __m256 d = _mm256_loadu_ps(depthRow(depth + dy * depth_stride, colmask, tmp));
+            covered &= _mm256_movemask_ps(_mm256_cmp_ps(zp, d, _CMP_LT_OQ));
+        }
+        mask |= std::uint64_t(covered) << (dy * BLOCK_SIZE);
+    }
+    return mask;
+}
+#endif
+
+std::uint64_t rasterizeBlock(const EdgeFunctions &ef, int ox, int oy, std::uint8_t colmask, int row_begin, int row_end,
+                             const float *depth, int depth_stride, float *z, SimdLevel level)
+{
+#ifdef SERIKA_X86
+    if (level == SimdLevel::AVX2)
+        return rasterizeBlockAVX2(ef, ox, oy, colmask, row_begin, row_end, depth, depth_stride, z);
+    if (level == SimdLevel::SSE)
+        return rasterizeBlockSSE(ef, ox, oy, colmask, row_begin, row_end, depth, depth_stride, z);
+#endif
+    return rasterizeBlockScalar(ef, ox, oy, colmask, row_begin, row_end, depth, depth_stride, z);
+}
+
+static void storeDepthScalar(const float *z, std::uint64_t mask, float *depth, int depth_stride)
+{
+    while (mask)
+    {
+        int bit = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        depth[bit % BLOCK_SIZE + bit / BLOCK_SIZE * depth_stride] = z[bit];
+    }
+}
+
+#ifdef SERIKA_X86
+// masked stores never touch the pixels of a row that are not written, so partial blocks at the buffer edge are safe
+__attribute__((target("avx2"))) static void storeDepthAVX2(const float *z, std::uint64_t mask, float *depth, int depth_stride)
+{
+    const __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    for (int dy = 0; mask; dy++, mask >>= BLOCK_SIZE)
+    {
+        if (!(mask & 0xFF))
+            continue;
+        __m256i row = _mm256_set1_epi32(mask & 0xFF);
+        __m256i store_mask = _mm256_cmpeq_epi32(_mm256_and_si256(row, lanes), lanes);
+        _mm256_maskstore_ps(depth + dy * depth_stride, store_mask, _mm256_loadu_ps(z + dy * BLOCK_SIZE));
+    }
+}
+#endif
+
+std::uint64_t rasterizeDepthBlock(const EdgeFunctions &ef, int ox, int oy, std::uint8_t colmask, int row_begin, int row_end,
+                                  float *depth, int depth_stride, SimdLevel level)
+{
+    float z[BLOCK_SIZE * BLOCK_SIZE];
+    std::uint64_t mask = rasterizeBlock(ef, ox, oy, colmask, row_begin, row_end, depth, depth_stride, z, level);
+#ifdef SERIKA_X86
+    if (level == SimdLevel::AVX2)
+    {
+        storeDepthAVX2(z, mask, depth, depth_stride);
+        return mask;
+    }
+#endif
+    storeDepthScalar(z, mask, depth, depth_stride);
+    return mask;
+}
+
+static void transformPositionsScalar(const mat4f &m, const float *xs, const float *ys, const float *zs, int count, vec4 *clip)
+{
+    for (int i = 0; i < count; i++)
+    {
+        for (int r = 0; r < 4; r++)
+            clip[i][r] = m[r][0] * xs[i] + m[r][3] + m[r][1] * ys[i] + m[r][2] * zs[i];
+    }
+}
+
+#ifdef SERIKA_X86
+__attribute__((target("sse4.2"))) static void transformPositionsSSE(const mat4f &m, const float *xs, const float *ys, const float *zs, int count, vec4 *clip)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(xs + i), y = _mm_loadu_ps(ys + i), z = _mm_loadu_ps(zs + i);
+        alignas(16) float c[4][4];
+        for (int r = 0; r < 4; r++)
+        {
+            __m128 v = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[r][0]), x), _mm_set1_ps(m[r][3]));
+            v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(m[r][1]), y));
+            v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(m[r][2]), z));
+            _mm_store_ps(c[r], v);
+        }
+        for (int k = 0; k < 4; k++)
+            clip[i + k] = {c[0][k], c[1][k], c[2][k], c[3][k]};
+    }
+    transformPositionsScalar(m, xs + i, ys + i, zs + i, count - i, clip + i);
+}
+
+__attribute__((target("avx2"))) static void transformPositionsAVX2(const mat4f &m, const float *xs, const float *ys, const float *zs, int count, vec4 *clip)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(xs + i), y = _mm256_loadu_ps(ys + i), z = _mm256_loadu_ps(zs + i);
+        alignas(32) float c[4][8];
+        for (int r = 0; r < 4; r++)
+        {
+            __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[r][0]), x), _mm256_set1_ps(m[r][3]));
+            v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_set1_ps(m[r][1]), y));
+            v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_set1_ps(m[r][2]), z));
+            _mm256_store_ps(c[r], v);
+        }
+        for (int k = 0; k < 8; k++)
+            clip[i + k] = {c[0][k], c[1][k], c[2][k], c[3][k]};
+    }
+    transformPositionsScalar(m, xs + i, ys + i, zs + i, count - i, clip + i);
+}
+#endif
+
+void transformPositions(const mat4f &m, const float *xs, const float *ys, const float *zs, int count, vec4 *clip, SimdLevel level)
+{
+#ifdef SERIKA_X86
+    if (level == SimdLevel::AVX2)
+        return transformPositionsAVX2(m, xs, ys, zs, count, clip);
+    if (level == SimdLevel::SSE)
+        return transformPositionsSSE(m, xs, ys, zs, count, clip);
+#endif
+    transformPositionsScalar(m, xs, ys, zs, count, clip);
+}
+
+static int log2Samples(int count)
+{
+    return count == 8 ? 3 : count == 4 ? 2 : count == 2 ? 1 : 0;
+}
+
+static void resolveSamplesScalar(const std::uint32_t *samples, int begin, int pixels, int count, std::uint32_t *out)
+{
+    const int shift = log2Samples(count);
+    for (int i = begin; i < pixels; i++)
+    {
+        std::uint32_t sum[4] = {};
+        for (int s = 0; s < count; s++)
+        {
+            std::uint32_t c = samples[i + s * pixels];
+            for (int k = 0; k < 4; k++)
+                sum[k] += (c >> (8 * k)) & 0xFF;
+        }
+        std::uint32_t ret = 0;
+        for (int k = 0; k < 4; k++)
+            ret |= ((sum[k] + (count >> 1)) >> shift) << (8 * k);
+        out[i] = ret;
+    }
+}
+
+#ifdef SERIKA_X86
+// channels are widened to 16 bits, 8 samples of 255 still fit
+__attribute__((target("sse4.2"))) static void resolveSamplesSSE(const std::uint32_t *samples, int pixels, int count, std::uint32_t *out)
+{
+    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(count >> 1);
+    const __m128i shift = _mm_cvtsi32_si128(log2Samples(count));
+    int i = 0;
+    for (; i + 4 <= pixels; i += 4)
+    {
+        __m128i lo = round, hi = round;
+        for (int s = 0; s < count; s++)
+        {
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(samples + i + s * pixels));
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(c, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(c, zero));
+        }
+        __m128i ret = _mm_packus_epi16(_mm_srl_epi16(lo, shift), _mm_srl_epi16(hi, shift));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), ret);
+    }
+    resolveSamplesScalar(samples, i, pixels, count, out);
+}
+
+__attribute__((target("avx2"))) static void resolveSamplesAVX2(const std::uint32_t *samples, int pixels, int count, std::uint32_t *out)
+{
+    const __m256i zero = _mm256_setzero_si256(), round = _mm256_set1_epi16(count >> 1);
+    const __m128i shift = _mm_cvtsi32_si128(log2Samples(count));
+    int i = 0;
+    for (; i + 8 <= pixels; i += 8)
+    {
+        __m256i lo = round, hi = round;
+        for (int s = 0; s < count; s++)
+        {
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(samples + i + s * pixels));
+            lo = _mm256_add_epi16(lo, _mm256_unpacklo_epi8(c, zero));
+            hi = _mm256_add_epi16(hi, _mm256_unpackhi_epi8(c, zero));
+        }
+        // unpack and pack both work within 128 bit lanes, so the pixel order is preserved
+        __m256i ret = _mm256_packus_epi16(_mm256_srl_epi16(lo, shift), _mm256_srl_epi16(hi, shift));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), ret);
+    }
+    resolveSamplesScalar(samples, i, pixels, count, out);
+}
+#endif
+
+void resolveSamples(const std::uint32_t *samples, int pixels, int count, std::uint32_t *out, SimdLevel level)
+{
+#ifdef SERIKA_X86
+    if (level == SimdLevel::AVX2)
+        return resolveSamplesAVX2(samples, pixels, count, out);
+    if (level == SimdLevel::SSE)
+        return resolveSamplesSSE(samples, pixels, count, out);
+#endif
+    resolveSamplesScalar(samples, 0, pixels, count, out);
+}
+
+static void swizzleBGRScalar(const std::uint8_t *src, int begin, int pixels, std::uint8_t *dst)
+{
+    for (int i = begin; i < pixels; i++)
+    {
+        dst[3 * i] = src[3 * i + 2];
+        dst[3 * i + 1] = src[3 * i + 1];
+        dst[3 * i + 2] = src[3 * i];
+    }
+}
+
+#ifdef SERIKA_X86
+// 16 pixels a step: three shuffles convert 5 pixels each, the 16th byte a store writes is overwritten by the next one
+// the last pixel is done apart, so nothing is read or written past the 48 bytes of the step
+__attribute__((target("sse4.2"))) static void swizzleBGRSSE(const std::uint8_t *src, int pixels, std::uint8_t *dst)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    int i = 0;
+    for (; i + 16 <= pixels; i += 16)
+    {
+        const std::uint8_t *s = src + 3 * i;
+        std::uint8_t *d = dst + 3 * i;
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 15));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 30));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d), _mm_shuffle_epi8(a, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d + 15), _mm_shuffle_epi8(b, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d + 30), _mm_shuffle_epi8(c, mask));
+        d[45] = s[47];
+        d[46] = s[46];
+        d[47] = s[45];
+    }
+    swizzleBGRScalar(src, i, pixels, dst);
+}
+#endif
+
+void swizzleBGR(const std::uint8_t *src, int pixels, std::uint8_t *dst, SimdLevel level)
+{
+#ifdef SERIKA_X86
+    if (level != SimdLevel::SCALAR)
+        return swizzleBGRSSE(src, pixels, dst);
+#endif
+    swizzleBGRScalar(src, 0, pixels, dst);
+}
+
+// depth + bias < z is evaluated in float against the smallest float not less than z, which gives the same answer
+static float ceilToFloat(const double z)
+{
+    float zf = z;
+    return zf < z ? std::nextafter(zf, INFINITY) : zf;
+}
+
+// bit (i + n * j) is set if tap (x0 + i, y0 + j) of the n x n taps is lit
+static std::uint32_t shadowTapsScalar(const float *depth, int width, int height, int x0, int y0, int n, float zf, float bias)
+{
+    std::uint32_t mask = 0;
+    for (int j = 0; j < n; j++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            int x = x0 + i, y = y0 + j;
+            bool lit = x < 0 || y < 0 || x >= width || y >= height || !(depth[x + y * width] + bias < zf);
+            mask |= std::uint32_t(lit) << (i + n * j);
+        }
+    }
+    return mask;
+}
+
+#ifdef SERIKA_X86
+// one row of taps per compare, rows of 5 take two loads, all loaded texels must be inside of the map
+__attribute__((target("sse4.2"))) static std::uint32_t shadowTapsSSE(const float *depth, int width, int x0, int y0, int n, float zf, float bias)
+{
+    const __m128 z = _mm_set1_ps(zf), b = _mm_set1_ps(bias);
+    const std::uint32_t row_mask = (1u << n) - 1;
+    std::uint32_t mask = 0;
+    for (int j = 0; j < n; j++)
+    {
+        const float *row = depth + x0 + (y0 + j) * width;
+        std::uint32_t lit = _mm_movemask_ps(_mm_cmpnlt_ps(_mm_add_ps(_mm_loadu_ps(row), b), z));
+        if (n > 4)
+            lit |= _mm_movemask_ps(_mm_cmpnlt_ps(_mm_add_ps(_mm_loadu_ps(row + 4), b), z)) << 4;
+        mask |= (lit & row_mask) << (n * j);
+    }
+    return mask;
+}
+
+// masked loads only touch the n texels of a row
+__attribute__((target("avx2"))) static std::uint32_t shadowTapsAVX2(const float *depth, int width, int x0, int y0, int n, float zf, float bias)
+{
+    const __m256 z = _mm256_set1_ps(zf), b = _mm256_set1_ps(bias);
+    const __m256i load_mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    const std::uint32_t row_mask = (1u << n) - 1;
+    std::uint32_t mask = 0;
+    for (int j = 0; j < n; j++)
+    {
+        __m256 d = _mm256_maskload_ps(depth + x0 + (y0 + j) * width, load_mask);
+        std::uint32_t lit = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_add_ps(d, b), z, _CMP_NLT_UQ));
+        mask |= (lit & row_mask) << (n * j);
+    }
+    return mask;
+}
+#endif
+
+float shadowPCF(const float *depth, int width, int height, double x, double y, double z, float bias, ShadowFilter filter, SimdLevel level)
+{
+    const int n = filter == ShadowFilter::PCF5x5 ? 5 : filter == ShadowFilter::PCF3x3 ? 3 : filter == ShadowFilter::PCF2x2 ? 2 : 1;
+    // every tap is outside of the map, this also keeps the conversions below in range
+    if (!(x > -n - 1 && y > -n - 1 && x < width + n && y < height + n))
+        return 1;
+    int x0, y0;
+    if (filter == ShadowFilter::NONE)
+    {
+        x0 = int(x);
+        y0 = int(y);
+    }
+    else if (filter == ShadowFilter::PCF2x2)
+    {
+        x0 = int(std::floor(x));
+        y0 = int(std::floor(y));
+    }
+    else
+    {
+        x0 = int(std::floor(x + 0.5)) - n / 2;
+        y0 = int(std::floor(y + 0.5)) - n / 2;
+    }
+
+    const float zf = ceilToFloat(z);
+    const bool inside = n > 1 && x0 >= 0 && y0 >= 0 && y0 + n <= height;
+    std::uint32_t mask;
+#ifdef SERIKA_X86
+    if (level == SimdLevel::AVX2 && inside && x0 + n <= width)
+        mask = shadowTapsAVX2(depth, width, x0, y0, n, zf, bias);
+    else if (level != SimdLevel::SCALAR && inside && x0 + (n > 4 ? 8 : 4) <= width)
+        mask = shadowTapsSSE(depth, width, x0, y0, n, zf, bias);
+    else
+#endif
+        mask = shadowTapsScalar(depth, width, height, x0, y0, n, zf, bias);
+
+    // away from shadow edges all taps agree and no weights are needed
+    if (mask == 0)
+        return 0;
+    if (mask == (1u << (n * n)) - 1)
+        return 1;
+    if (filter == ShadowFilter::PCF2x2)
+    {
+        float fx = x - x0, fy = y - y0;
+        float w[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+        float ret = 0;
+        for (int i = 0; i < 4; i++)
+            ret += (mask >> i & 1) ? w[i] : 0;
+        return ret;
+    }
+    return __builtin_popcount(mask) / float(n * n);
+}
+
+// out[i] = sum of w[k] * src[k][i] over the taps, summed in tap order by every implementation
+static void convolveScalar(const float *const *src, const float *w, int taps, float *out, int begin, int count)
+{
+    for (int i = begin; i < count; i++)
+    {
+        float sum = 0;
+        for (int k = 0; k < taps; k++)
+            sum += w[k] * src[k][i];
+        out[i] = sum;
+    }
+}
+
+#ifdef SERIKA_X86
+__attribute__((target("sse4.2"))) static void convolveSSE(const float *const *src, const float *w, int taps, float *out, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < taps; k++)
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(src[k] + i)));
+        _mm_storeu_ps(out + i, sum);
+    }
+    convolveScalar(src, w, taps, out, i, count);
+}
+
+__attribute__((target("avx2"))) static void convolveAVX2(const float *const *src, const float *w, int taps, float *out, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < taps; k++)
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(w[k]), _mm256_loadu_ps(src[k] + i)));
+        _mm256_storeu_ps(out + i, sum);
+    }
+    convolveScalar(src, w, taps, out, i, count);
+}
+#endif
+
+static void convolve(const float *const *src, const float *w, int taps, float *out, int count, SimdLevel level)
+{
+#ifdef SERIKA_X86
+    if (level == SimdLevel::AVX2)
+        return convolveAVX2(src, w, taps, out, count);
+    if (level == SimdLevel::SSE)
+        return convolveSSE(src, w, taps, out, count);
+#endif
+    convolveScalar(src, w, taps, out, 0, count);
+}
+
+void gaussianBlur(float *data, int width, int height, int radius, SimdLevel level)
+{
+    if (radius <= 0 || width <= 0 || height <= 0)
+        return;
+    const int taps = 2 * radius + 1;
+    std::vector<float> w(taps);
+    float total = 0;
+    for (int k = 0; k < taps; k++)
+    {
+        float d = float(k - radius) / (0.5f * radius);
+        w[k] = std::exp(-0.5f * d * d);
+        total += w[k];
+    }
+    for (auto &wk : w)
+        wk /= total;
+
+    // 横向：每行先复制到两端按边缘值补齐的临时行，卷积时不需要再判断边界
+    std::vector<float> tmp(std::size_t(width) * height);
+#pragma omp parallel
+    {
+        std::vector<float> padded(width + 2 * radius);
+        std::vector<const float *> src(taps);
+#pragma omp for
+        for (int y = 0; y < height; y++)
+        {
+            const float *row = data + std::size_t(y) * width;
+            for (int i = 0; i < width + 2 * radius; i++)
+                padded[i] = row[std::min(std::max(i - radius, 0), width - 1)];
+            for (int k = 0; k < taps; k++)
+                src[k] = padded.data() + k;
+            convolve(src.data(), w.data(), taps, tmp.data() + std::size_t(y) * width, width, level);
+        }
+
+        // 纵向：同一列的taps来自相邻的行，整行一起算
+#pragma omp for
+        for (int y = 0; y < height; y++)
+        {
+            for (int k = 0; k < taps; k++)
+                src[k] = tmp.data() + std::size_t(std::min(std::max(y + k - radius, 0), height - 1)) * width;
+            convolve(src.data(), w.data(), taps, data + std::size_t(y) * width, width, level);
+        }
+    }
+}
@@ -0,0 +1,176 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+
+// 8 bits of sub-pixel precision, vertices are snapped to a 1/256 pixel grid
+constexpr int SUBPIXEL_BITS = 8;
+constexpr std::int64_t SUBPIXEL_ONE = std::int64_t(1) << SUBPIXEL_BITS;
+// vertices farther than this (in pixels) would overflow the 64 bit edge functions
+constexpr double GUARD_BAND = 1 << 21;
+// pixels are rasterized in 8x8 blocks aligned to the screen grid
+constexpr int BLOCK_SIZE = 8;
+// slack for the hierarchical-z test, interpolated depth may round slightly below the exact plane
+constexpr double HIZ_EPSILON = 1e-5;
+
+// multisampling: at most 8 samples per pixel, sample offsets are given in 1/16 pixel
+constexpr int MAX_SAMPLES = 8;
+constexpr int SAMPLE_GRID = 16;
+
+// rotated grid sample positions (the standard D3D patterns), offsets of every pattern sum to zero
+struct SamplePattern
+{
+    int count;
+    int offsets[MAX_SAMPLES][2];
+};
+
+// pattern for 1, 2, 4 or 8 samples, other counts are rounded down to one of these
+const SamplePattern &getSamplePattern(int count);
+
+enum class SimdLevel
+{
+    SCALAR,
+    SSE,
+    AVX2
+};
+
+// best instruction set supported by the running cpu
+SimdLevel detectSimdLevel();
+
+// output of the vertex stage for one pass, kept apart from the mesh so that it can be transformed for several views
+struct TransformedVertices
+{
+    std::vector<vec4> clip;
+    std::vector<vec3> screen;
+};
+
+// clip[i] = m * (xs[i], ys[i], zs[i], 1), positions come as separate x, y, z streams
+void transformPositions(const mat4f &m, const float *xs, const float *ys, const float *zs, int count, vec4 *clip, SimdLevel level);
+
+// screen-space linear function f(x, y) = dx * x + dy * y + c
+struct Plane
+{
+    double dx = 0, dy = 0, c = 0;
+    double at(const double x, const double y) const { return dx * x + dy * y + c; }
+};
+
+// integer edge functions of a screen-space triangle, set up once per triangle
+// w_i(x, y) = A_i * x + B_i * y + C_i at pixel (x, y), w_i is the edge opposite to vertex i
+// the triangle is oriented so that the inside is w_i >= 0, the top-left fill rule is folded into C_i
+struct EdgeFunctions
+{
+    std::int64_t A[3], B[3], C[3];
+    std::int64_t bias[3];
+    double inv_area;
+    // depth plane z(x, y) = Zx * x + Zy * y + Zc
+    double Zx, Zy, Zc;
+
+    // returns false for degenerate triangles or triangles outside the guard band
+    bool setup(const vec3 *pts);
+
+    // the same triangle sampled at (x + sx / 16, y + sy / 16), exact since A and B are multiples of SUBPIXEL_ONE
+    EdgeFunctions offset(const int sx, const int sy) const
+    {
+        EdgeFunctions ret = *this;
+        for (int i = 0; i < 3; i++)
+            ret.C[i] += (A[i] * sx + B[i] * sy) / SAMPLE_GRID;
+        ret.Zc += (Zx * sx + Zy * sy) / SAMPLE_GRID;
+        return ret;
+    }
+
+    std::int64_t at(const int i, const int x, const int y) const
+    {
+        return A[i] * x + B[i] * y + C[i];
+    }
+    std::int64_t stepX(const int i) const { return A[i]; }
+    std::int64_t stepY(const int i) const { return B[i]; }
+
+    // plane interpolating the values a_i given at the three vertices
+    Plane plane(const double a0, const double a1, const double a2) const
+    {
+        const double a[3] = {a0, a1, a2};
+        Plane ret;
+        for (int i = 0; i < 3; i++)
+        {
+            ret.dx += a[i] * A[i] * inv_area;
+            ret.dy += a[i] * B[i] * inv_area;
+            ret.c += a[i] * (C[i] + bias[i]) * inv_area;
+        }
+        return ret;
+    }
+
+    // barycentric coordinates without any division, w are the (biased) edge values of a covered pixel
+    vec3 barycentric(const std::int64_t *w) const
+    {
+        return {(w[0] + bias[0]) * inv_area, (w[1] + bias[1]) * inv_area, (w[2] + bias[2]) * inv_area};
+    }
+};
+
+// coverage and depth test of the 8x8 block with top-left pixel (ox, oy)
+// only columns set in colmask and rows in [row_begin, row_end] are considered
+// returns a mask with bit (dx + 8 * dy) set for covered pixels whose depth is less than the one in depth,
+// depth points to pixel (ox, oy) of a row-major float buffer and may be null to skip the depth test
+// z receives the interpolated depth of every covered pixel, all simd levels give bit-identical results
+std::uint64_t rasterizeBlock(const EdgeFunctions &ef, int ox, int oy, std::uint8_t colmask, int row_begin, int row_end,
+                             const float *depth, int depth_stride, float *z, SimdLevel level);
+
+// depth-only variant for shadow maps and depth pre-passes: covered pixels nearer than depth are written to it
+// depth points to pixel (ox, oy) and must not be null, returns the mask of the written pixels
+std::uint64_t rasterizeDepthBlock(const EdgeFunctions &ef, int ox, int oy, std::uint8_t colmask, int row_begin, int row_end,
+                                  float *depth, int depth_stride, SimdLevel level);
+
+// averages count sample planes of packed 8 bit bgra colors per channel with rounding, count is 1, 2, 4 or 8
+// samples holds count consecutive planes of pixels colors each
+void resolveSamples(const std::uint32_t *samples, int pixels, int count, std::uint32_t *out, SimdLevel level);
+
+// 24 bit bgr pixels to rgb, for writing the color buffer to formats that store rgb, src and dst must not overlap
+void swizzleBGR(const std::uint8_t *src, int pixels, std::uint8_t *dst, SimdLevel level);
+
+// percentage-closer filtering kernel of the shadow map lookup
+enum class ShadowFilter
+{
+    // single texel, hard edges
+    NONE,
+    // the 2x2 texels around the lookup, weighted bilinearly like a hardware comparison sampler
+    PCF2x2,
+    // box of 3x3 or 5x5 texels centered on the nearest one
+    PCF3x3,
+    PCF5x5
+};
+
+// fraction of the shadow map taps around (x, y) that are lit, a tap is lit unless depth + bias < z
+// depth is a row-major width x height map with texel (i, j) sampled at (i, j), taps outside of it are lit
+// all simd levels give bit-identical results
+float shadowPCF(const float *depth, int width, int height, double x, double y, double z, float bias, ShadowFilter filter, SimdLevel level);
+
+// separable gaussian blur of a row-major float image in place, 2 * radius + 1 taps per direction with sigma = radius / 2
+// edges are clamped, rows are filtered in parallel, all simd levels give bit-identical results
+void gaussianBlur(float *data, int width, int height, int radius, SimdLevel level);
+
+// per-triangle attribute setup, the fragment stage only evaluates these linear functions
+struct AttributePlanes
+{
+    Plane world_pos[3];
+    Plane uv[2];
+    Plane normal[3];
+
+    void setup(const EdgeFunctions &ef, const vec3 *world_pos, const vec2 *uv, const vec3 *normal)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            this->world_pos[i] = ef.plane(world_pos[0][i], world_pos[1][i], world_pos[2][i]);
+            this->normal[i] = ef.plane(normal[0][i], normal[1][i], normal[2][i]);
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            this->uv[i] = ef.plane(uv[0][i], uv[1][i], uv[2][i]);
+        }
+    }
+
+    void eval(const double x, const double y, vec3 &world_pos, vec2 &uv, vec3 &normal) const
+    {
+        world_pos = {this->world_pos[0].at(x, y), this->world_pos[1].at(x, y), this->world_pos[2].at(x, y)};
+        uv = {this->uv[0].at(x, y), this->uv[1].at(x, y)};
+        normal = {this->normal[0].at(x, y), this->normal[1].at(x, y), this->normal[2].at(x, y)};
+    }
+};
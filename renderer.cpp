@@ -1,233 +1,913 @@
 #include "renderer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include "transforms.h"
 
-TGAColor pack(float src)
+// 透视投影把相机前方的点映射到w < 0，统一成w > 0再做裁剪
+static double getClipSign(const mat4 &project)
 {
-    TGAColor dst;
-    auto p = reinterpret_cast<std::uint8_t *>(&src);
-    for (int i = 0; i < 4; i++)
-    {
-        dst[i] = *(p + i);
-    }
-    return dst;
-}
-
-float unpack(TGAColor &src)
-{
-    auto fp = reinterpret_cast<float *>(src.bgra);
-    return *fp;
-}
-
-float unpack(TGAColor &&src)
-{
-    auto fp = reinterpret_cast<float *>(src.bgra);
-    return *fp;
+    return (project * vec4{0, 0, -1, 1})[3] < 0 ? -1.0 : 1.0;
 }
 
 void Renderer::updateMVP()
 {
     MVP = project * lookat * model;
     toScreen = viewport * MVP;
+    clip_sign = getClipSign(project);
+}
+
+// bounds of points after an affine transform
+static void transformedBounds(const mat4 &m, const vec3 *pts, int count, vec3 &bbox_min, vec3 &bbox_max)
+{
+    for (int i = 0; i < count; i++)
+    {
+        vec3 p = proj<3>(m * embed<4>(pts[i], 1.0));
+        for (int k = 0; k < 3; k++)
+        {
+            bbox_min[k] = i ? std::min(bbox_min[k], p[k]) : p[k];
+            bbox_max[k] = i ? std::max(bbox_max[k], p[k]) : p[k];
+        }
+    }
 }
 
 void Renderer::generateShadowMap(const Scene &scene)
 {
+    vec3 scene_min, scene_max;
+    if (!scene.bounds(scene_min, scene_max))
+        return;
+    vec3 scene_corners[8];
+    for (int i = 0; i < 8; i++)
+    {
+        scene_corners[i] = {i & 1 ? scene_max.x : scene_min.x, i & 2 ? scene_max.y : scene_min.y, i & 4 ? scene_max.z : scene_min.z};
+    }
+
+    // 相机视锥的近、远平面四个角，以及场景在视线方向上实际占据的深度范围
+    shadow_camera_view = lookat * model;
+    auto viewDepth = [&](const vec3 &p) -> double
+    { return -(shadow_camera_view * embed<4>(p, 1.0))[2]; };
+    const mat4 inv_MVP = MVP.invert();
+    vec3 frustum[2][4];
+    for (int p = 0; p < 2; p++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            vec4 corner = inv_MVP * vec4{c & 1 ? 1.0 : -1.0, c & 2 ? 1.0 : -1.0, p ? 1.0 : -1.0, 1.0};
+            frustum[p][c] = proj<3>(corner / corner[3]);
+        }
+    }
+    if (viewDepth(frustum[0][0]) > viewDepth(frustum[1][0]))
+    {
+        std::swap(frustum[0], frustum[1]);
+    }
+    const double near = viewDepth(frustum[0][0]), far = viewDepth(frustum[1][0]);
+    double depth_min = far, depth_max = near;
+    for (auto &p : scene_corners)
+    {
+        depth_min = std::min(depth_min, viewDepth(p));
+        depth_max = std::max(depth_max, viewDepth(p));
+    }
+    depth_min = std::max(depth_min, near);
+    depth_max = std::min(depth_max, far);
+    if (depth_min >= depth_max)
+    {
+        depth_min = near;
+        depth_max = far;
+    }
+
+    // practical split scheme: half logarithmic, half uniform
+    const int count = shadow_cascades;
+    double splits[MAX_SHADOW_CASCADES + 1];
+    for (int i = 0; i <= count; i++)
+    {
+        double t = double(i) / count;
+        double uniform = depth_min + (depth_max - depth_min) * t;
+        double logarithmic = depth_min > 0 ? depth_min * std::pow(depth_max / depth_min, t) : uniform;
+        splits[i] = (uniform + logarithmic) / 2;
+    }
+
     for (auto light : scene.dirlights)
     {
-        light->shadowmap = std::make_shared<TGAImage>(shadowmap_resolution, shadowmap_resolution, 4);
-        light->shadowmap->clear(pack(zDepth));
-        auto view = get_lookAt(light->lightDir * (camera.eye - camera.focus).norm(), camera.focus, camera.up);
-        auto project = get_ortho_projection(5, 5, 5, 5, 0.2, 80);
-        auto viewport = get_viewport(shadowmap_resolution, shadowmap_resolution, zDepth);
-        light->MVP_viewport = viewport * project * view;
-        for (auto mesh : scene.meshes)
+        // 光源空间只取决于光的方向，和相机无关，相机移动时单个cascade可以沿用
+        vec3 light_up = std::abs(light->lightDir.y) > 0.99 ? vec3{0, 0, 1} : vec3{0, 1, 0};
+        auto view = get_lookAt(light->lightDir, {0, 0, 0}, light_up);
+        vec3 light_min, light_max;
+        transformedBounds(view, scene_corners, 8, light_min, light_max);
+
+        light->cascades.resize(count);
+        for (int i = 0; i < count; i++)
         {
-            cur_mesh = mesh.get();
-            for (auto &v : mesh->vertices)
+            ShadowCascade &cascade = light->cascades[i];
+            vec3 box_min = light_min, box_max = light_max;
+            if (count > 1)
             {
-                auto scpos = light->MVP_viewport * embed<4>(v.pos, 1.0);
-                v.screen_coord = proj<3>(scpos / scpos[3]);
+                // x, y: the part of the frustum slice the scene overlaps, z: every caster between the slice and the light
+                vec3 slice[8];
+                for (int c = 0; c < 4; c++)
+                {
+                    vec3 edge = frustum[1][c] - frustum[0][c];
+                    slice[c] = frustum[0][c] + edge * ((splits[i] - near) / (far - near));
+                    slice[c + 4] = frustum[0][c] + edge * ((splits[i + 1] - near) / (far - near));
+                }
+                vec3 slice_min, slice_max;
+                transformedBounds(view, slice, 8, slice_min, slice_max);
+                for (int k = 0; k < 2; k++)
+                {
+                    box_min[k] = std::max(box_min[k], slice_min[k]);
+                    box_max[k] = std::min(box_max[k], slice_max[k]);
+                    if (box_min[k] >= box_max[k])
+                    {
+                        box_min[k] = slice_min[k];
+                        box_max[k] = slice_max[k];
+                    }
+                }
             }
+            // 深度方向留一点余量，贴着包围盒的三角形不会被近远平面裁掉
+            double pad = (box_max.z - box_min.z) * 0.01 + 1e-4;
+            box_min.z -= pad;
+            box_max.z += pad;
+            auto project = get_ortho_projection(box_max.y, -box_min.y, box_max.x, -box_min.x, -box_max.z, -box_min.z);
+            auto viewport = get_viewport(shadowmap_resolution, shadowmap_resolution, zDepth);
+            mat4 MVP_viewport = viewport * project * view;
+            cascade.split = i + 1 < count ? splits[i + 1] : INFINITY;
+            cascade.bias = shadow_bias * zDepth / (box_max.z - box_min.z);
 
-            for (auto t : mesh->triangles)
+            const bool resized = !cascade.shadowmap || cascade.shadowmap->getWidth() != shadowmap_resolution || cascade.shadowmap->getHeight() != shadowmap_resolution;
+            // 光源和几何都没有变化时沿用上一帧的shadow map，比如只有相机在绕着焦点转
+            if (!resized && !shadow_dirty && cascade.generation == scene.generation && cascade.MVP_viewport == MVP_viewport)
             {
-                render(t, AttachmentType::SHADOWMAP, *light->shadowmap);
+                continue;
             }
+            if (resized)
+            {
+                cascade.shadowmap = std::make_shared<Buffer<float>>(shadowmap_resolution, shadowmap_resolution, zDepth);
+            }
+            else
+            {
+                cascade.shadowmap->clear(zDepth);
+            }
+            cascade.MVP_viewport = MVP_viewport;
+            cascade.generation = scene.generation;
+            shadowmap_target = cascade.shadowmap.get();
+            auto light_clip = project * view * getClipSign(project);
+            for (auto mesh : scene.meshes)
+            {
+                transformVertices(*mesh, light_clip, viewport, light_vertices);
+                enqueue(*mesh, light_vertices, viewport, shadow_cull_mode);
+                flush(AttachmentType::SHADOWMAP, colorBuffer);
+            }
+            buildShadowMoments(cascade);
         }
     }
+    shadowmap_target = nullptr;
+    shadow_dirty = false;
+}
+
+void Renderer::buildShadowMoments(ShadowCascade &cascade)
+{
+    const int w = cascade.shadowmap->getWidth(), h = cascade.shadowmap->getHeight();
+    const int planes = shadow_technique == ShadowTechnique::VSM ? 2 : shadow_technique == ShadowTechnique::ESM ? 1 : 0;
+    for (int i = 0; i < 2; i++)
+    {
+        if (i >= planes)
+            cascade.moments[i] = {};
+        else if (cascade.moments[i].getWidth() != w || cascade.moments[i].getHeight() != h)
+            cascade.moments[i] = Buffer<float>(w, h, 0);
+    }
+    if (!planes)
+        return;
+
+    const float *depth = cascade.shadowmap->getData();
+    float *m0 = cascade.moments[0].getData();
+    float *m1 = planes > 1 ? cascade.moments[1].getData() : nullptr;
+    const float c = esm_exponent / zDepth;
+#pragma omp parallel for
+    for (int i = 0; i < w * h; i++)
+    {
+        if (shadow_technique == ShadowTechnique::ESM)
+        {
+            m0[i] = std::exp(c * depth[i]);
+        }
+        else
+        {
+            m0[i] = depth[i];
+            m1[i] = depth[i] * depth[i];
+        }
+    }
+    // 预先模糊一次，着色时一次双线性采样就能得到整个半影区域的平均
+    for (int i = 0; i < planes; i++)
+    {
+        gaussianBlur(cascade.moments[i].getData(), w, h, shadow_blur_radius, simd_level);
+    }
+}
+
+float Renderer::filteredShadow(const ShadowCascade &cascade, const vec3 &p) const
+{
+    // bilinear fetch of the moments, texel (i, j) is at (i, j), outside of the map is lit
+    const Buffer<float> &m0 = cascade.moments[0];
+    const int w = m0.getWidth(), h = m0.getHeight();
+    if (!(p.x > -1 && p.y > -1 && p.x < w && p.y < h))
+        return 1;
+    int x0 = std::floor(p.x), y0 = std::floor(p.y);
+    float fx = p.x - x0, fy = p.y - y0;
+    int xs[2] = {std::max(x0, 0), std::min(x0 + 1, w - 1)}, ys[2] = {std::max(y0, 0), std::min(y0 + 1, h - 1)};
+    auto fetch = [&](const Buffer<float> &m)
+    {
+        float top = m.getElem(xs[0], ys[0]) * (1 - fx) + m.getElem(xs[1], ys[0]) * fx;
+        float bottom = m.getElem(xs[0], ys[1]) * (1 - fx) + m.getElem(xs[1], ys[1]) * fx;
+        return top * (1 - fy) + bottom * fy;
+    };
+
+    const float z = p.z - cascade.bias;
+    if (shadow_technique == ShadowTechnique::ESM)
+    {
+        // exp(c * (occluder - receiver))，接收者在遮挡物前面时大于1
+        return std::clamp(fetch(m0) * std::exp(-esm_exponent / zDepth * z), 0.0f, 1.0f);
+    }
+    // chebyshev upper bound of the lit fraction, the low end is cut off to reduce light bleeding
+    const float mean = fetch(m0), mean_sq = fetch(cascade.moments[1]);
+    if (z <= mean)
+        return 1;
+    const float variance = std::max(mean_sq - mean * mean, 1e-6f * zDepth * zDepth);
+    const float d = z - mean;
+    const float p_max = variance / (variance + d * d);
+    const float bleeding = 0.2f;
+    return std::clamp((p_max - bleeding) / (1 - bleeding), 0.0f, 1.0f);
 }
 
 void Renderer::render(const Scene &scene)
 {
     cur_scene = &scene;
+    // 每一帧都从空的颜色和深度开始，shadow map则可能沿用上一帧的
+    depthBuffer.clear(1.0);
+    hizBuffer.clear(1.0);
+    sampleBuffer.clear(0);
+    colorBuffer.clear();
     generateShadowMap(scene);
+    if (deferred)
+    {
+        clearGBuffer();
+    }
     for (auto mesh : scene.meshes)
     {
-        cur_mesh = mesh.get();
         render(mesh, scene);
     }
+    if (deferred)
+    {
+        shadeGBuffer();
+    }
+    else if (sample_rate > 1)
+    {
+        resolve();
+    }
 
     // 世界坐标系的axis不应该应用Model变换
     drawAxis();
 }
 
-void Renderer::render(std::shared_ptr<Mesh> mesh, const Scene &scene)
+void Renderer::transformVertices(const Mesh &mesh, const mat4 &clip, const mat4 &viewport, TransformedVertices &out)
 {
+    const int n = mesh.pos_x.size();
+    const mat4f m = clip.cast<float>();
+    out.clip.resize(n);
+    out.screen.resize(n);
+    // 分块并行，每块内部用simd从SoA的位置流里一次变换多个顶点
+    const int chunk = 1024;
+#pragma omp parallel for schedule(static)
+    for (int begin = 0; begin < n; begin += chunk)
+    {
+        int count = std::min(chunk, n - begin);
+        transformPositions(m, mesh.pos_x.data() + begin, mesh.pos_y.data() + begin, mesh.pos_z.data() + begin, count,
+                           out.clip.data() + begin, simd_level);
+        for (int i = begin; i < begin + count; i++)
+        {
+            out.screen[i] = proj<3, 4>(viewport * out.clip[i] / out.clip[i][3]);
+        }
+    }
+}
+
+void Renderer::render(std::shared_ptr<const Mesh> mesh, const Scene &scene)
+{
+    cur_scene = &scene;
     // vertex shader
-    for (auto &v : mesh->vertices)
+    transformVertices(*mesh, MVP * clip_sign, viewport, camera_vertices);
+
+    // primitive assembly: cull and clip
+    // 在世界空间里用视线去cull会导致缺少三角形、出现黑线，所以在屏幕空间按绕序cull
+    enqueue(*mesh, camera_vertices, viewport, cull_mode);
+
+    // rasterization
+    // deferred模式下这里只写G-buffer，着色在shadeGBuffer中对每个可见像素只做一次
+    flush(deferred ? AttachmentType::GBUFFER : AttachmentType::COLOR, colorBuffer);
+}
+
+// bbox of a screen-space triangle clamped to the renderer's viewport
+// margin widens it for sample positions that are off the pixel's integer coordinates
+static TileRect getBBox(const vec3 *pts, int width, int height, real margin = 0)
+{
+    vec2 bbox_min = {width - 1, height - 1};
+    vec2 bbox_max = {0, 0};
+    vec2 limits = {width - 1, height - 1};
+    for (int i = 0; i < 3; i++)
+    {
+        bbox_max.x = std::min(limits.x, std::max(bbox_max.x, pts[i].x + margin));
+        bbox_max.y = std::min(limits.y, std::max(bbox_max.y, pts[i].y + margin));
+
+        bbox_min.x = std::max<real>(0, std::min(bbox_min.x, pts[i].x - margin));
+        bbox_min.y = std::max<real>(0, std::min(bbox_min.y, pts[i].y - margin));
+    }
+    return {int(bbox_min.x), int(bbox_min.y), int(bbox_max.x), int(bbox_max.y)};
+}
+
+// outcodes of a clip-space vertex against the view frustum (w > 0 in front of the camera)
+enum ClipCode
+{
+    CLIP_LEFT = 1,
+    CLIP_RIGHT = 2,
+    CLIP_BOTTOM = 4,
+    CLIP_TOP = 8,
+    // ndc z = 1 is the near plane
+    CLIP_NEAR = 16,
+    CLIP_FAR = 32
+};
+
+static int getClipCode(const vec4 &c, const double k)
+{
+    return (c[0] < -k * c[3] ? CLIP_LEFT : 0) | (c[0] > k * c[3] ? CLIP_RIGHT : 0) |
+           (c[1] < -k * c[3] ? CLIP_BOTTOM : 0) | (c[1] > k * c[3] ? CLIP_TOP : 0) |
+           (c[2] > c[3] ? CLIP_NEAR : 0) | (c[2] < -c[3] ? CLIP_FAR : 0);
+}
+
+struct ClipVertex
+{
+    vec4 clip;
+    vec3 bary;
+};
+
+// Sutherland-Hodgman against plane * v >= 0, returns the new vertex count
+static int clipPolygon(const ClipVertex *in, int n, ClipVertex *out, const vec4 &plane)
+{
+    int m = 0;
+    for (int i = 0; i < n; i++)
+    {
+        const ClipVertex &a = in[i], &b = in[(i + 1) % n];
+        double da = plane * a.clip, db = plane * b.clip;
+        if (da >= 0)
+            out[m++] = a;
+        if ((da >= 0) != (db >= 0))
+        {
+            double s = da / (da - db);
+            out[m++] = {a.clip + (b.clip - a.clip) * s, a.bary + (b.bary - a.bary) * s};
+        }
+    }
+    return m;
+}
+
+// 屏幕空间的有向面积，逆时针（正）为正面
+static bool isCulled(const vec3 *pts, CullMode cull)
+{
+    if (cull == CullMode::NONE)
+        return false;
+    double area = (pts[1].x - pts[0].x) * (pts[2].y - pts[0].y) - (pts[1].y - pts[0].y) * (pts[2].x - pts[0].x);
+    return cull == CullMode::BACK ? area < 0 : area > 0;
+}
+
+void Renderer::enqueue(const Mesh &mesh, const TransformedVertices &verts, const mat4 &viewport, CullMode cull)
+{
+    // guard band: only triangles reaching beyond what the fixed point rasterizer can hold are clipped in x and y,
+    // everything else just relies on the bbox being clamped to the screen
+    const double guard = 0.5 * GUARD_BAND / std::max(std::abs(viewport[0][0]), std::abs(viewport[1][1]));
+    const vec4 clip_planes[5] = {
+        {0, 0, -1, 1},
+        {1, 0, 0, guard},
+        {-1, 0, 0, guard},
+        {0, 1, 0, guard},
+        {0, -1, 0, guard}};
+
+    for (auto &t : mesh.triangles)
+    {
+        int frustum_and = ~0, frustum_or = 0, guard_or = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            const vec4 &c = verts.clip[t.indices[i]];
+            frustum_and &= getClipCode(c, 1.0);
+            frustum_or |= getClipCode(c, 1.0);
+            guard_or |= getClipCode(c, guard);
+        }
+        // all three vertices outside of the same frustum plane
+        if (frustum_and)
+        {
+            stats.triangles_frustum_culled++;
+            continue;
+        }
+
+        RasterTriangle rt = {&t, &mesh};
+        if (!(frustum_or & CLIP_NEAR) && !(guard_or & ~(CLIP_NEAR | CLIP_FAR)))
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                rt.pts[i] = verts.screen[t.indices[i]];
+            }
+            if (isCulled(rt.pts, cull))
+            {
+                stats.triangles_backface_culled++;
+                continue;
+            }
+            raster_queue.push_back(rt);
+            continue;
+        }
+
+        // clip in homogeneous space, against the near plane and the guard band
+        stats.triangles_clipped++;
+        ClipVertex poly[2][16];
+        int n = 3;
+        for (int i = 0; i < 3; i++)
+        {
+            poly[0][i] = {verts.clip[t.indices[i]], {}};
+            poly[0][i].bary[i] = 1;
+        }
+        int cur = 0;
+        for (int p = 0; p < 5 && n; p++)
+        {
+            if (p == 0 ? !(frustum_or & CLIP_NEAR) : !(guard_or & (1 << (p - 1))))
+                continue;
+            n = clipPolygon(poly[cur], n, poly[1 - cur], clip_planes[p]);
+            cur = 1 - cur;
+        }
+
+        // triangle fan
+        rt.clipped = true;
+        for (int i = 1; i + 1 < n; i++)
+        {
+            const ClipVertex *corners[3] = {&poly[cur][0], &poly[cur][i], &poly[cur][i + 1]};
+            for (int j = 0; j < 3; j++)
+            {
+                rt.pts[j] = proj<3>(viewport * corners[j]->clip / corners[j]->clip[3]);
+                rt.bary[j] = corners[j]->bary;
+            }
+            if (isCulled(rt.pts, cull))
+            {
+                stats.triangles_backface_culled++;
+                continue;
+            }
+            raster_queue.push_back(rt);
+        }
+    }
+}
+
+void Renderer::setup(RasterTriangle &rt, AttachmentType type)
+{
+    rt.valid = rt.ef.setup(rt.pts);
+    if (!rt.valid || type == AttachmentType::SHADOWMAP)
+        return;
+
+    // 被裁剪的三角形的顶点属性由原三角形的重心坐标插值得到
+    vec3 world_pos[3], normal[3];
+    vec2 uv[3];
+    for (int k = 0; k < 3; k++)
     {
-        auto scpos = toScreen * embed<4, 3>(v.pos, 1.0);
-        scpos = scpos / scpos[3];
-        v.screen_coord = proj<3, 4>(scpos);
+        if (!rt.clipped)
+        {
+            world_pos[k] = rt.t->vertices[k]->pos;
+            uv[k] = rt.t->vertices[k]->tex_coord;
+            normal[k] = rt.t->vertices[k]->norm;
+            continue;
+        }
+        world_pos[k] = {0, 0, 0};
+        uv[k] = {0, 0};
+        normal[k] = {0, 0, 0};
+        for (int i = 0; i < 3; i++)
+        {
+            world_pos[k] = world_pos[k] + rt.t->vertices[i]->pos * rt.bary[k][i];
+            uv[k] = uv[k] + rt.t->vertices[i]->tex_coord * rt.bary[k][i];
+            normal[k] = normal[k] + rt.t->vertices[i]->norm * rt.bary[k][i];
+        }
+    }
+    rt.attr.setup(rt.ef, world_pos, uv, normal);
+}
+
+void Renderer::flush(AttachmentType type, TGAImage &renderTarget)
+{
+    // triangle setup once per triangle, not once per tile
+#pragma omp parallel for
+    for (int i = 0; i < (int)raster_queue.size(); i++)
+    {
+        setup(raster_queue[i], type);
+    }
+
+    if (!tiled)
+    {
+        TileRect screen = {0, 0, targetWidth(type) - 1, targetHeight(type) - 1};
+        for (auto &rt : raster_queue)
+        {
+            if (type == AttachmentType::SHADOWMAP)
+                rasterizeDepth(rt, *shadowmap_target, screen, shadow_slope_bias);
+            else
+                rasterize(rt, type, renderTarget, screen, stats);
+        }
+        raster_queue.clear();
+        return;
     }
 
-    for (auto t : mesh->triangles)
+    // binning: 三角形按提交顺序进入各个tile，因此每个像素上的绘制顺序与串行路径一致
+    const double margin = type == AttachmentType::COLOR && sample_rate > 1 ? 0.5 : 0;
+    const int target_width = targetWidth(type), target_height = targetHeight(type);
+    int tiles_x = (target_width + tile_size - 1) / tile_size;
+    int tiles_y = (target_height + tile_size - 1) / tile_size;
+    tile_bins.resize(tiles_x * tiles_y);
+    for (auto &bin : tile_bins)
     {
-        // cull
-        // 这样cull三角形会导致缺少三角形,不是用光线去cull，而是用视线去cull
-        // vec3 sight = (camera.eye - camera.focus).normalized();
-        // vec3 face_norm = (t.vertices[1]->pos - t.vertices[0]->pos) ^ (t.vertices[2]->pos - t.vertices[0]->pos);
-        // face_norm = face_norm.normalized();
-        // if (sight * face_norm < 0)
-        //     continue;
-        // 用视线去cull仍然会有黑线问题
+        bin.clear();
+    }
+    for (int i = 0; i < (int)raster_queue.size(); i++)
+    {
+        if (!raster_queue[i].valid)
+            continue;
+        TileRect bbox = getBBox(raster_queue[i].pts, target_width, target_height, margin);
+        for (int ty = bbox.y0 / tile_size; ty <= bbox.y1 / tile_size; ty++)
+        {
+            for (int tx = bbox.x0 / tile_size; tx <= bbox.x1 / tile_size; tx++)
+            {
+                tile_bins[tx + ty * tiles_x].push_back(i);
+            }
+        }
+    }
 
-        // rasterization
-        render(t, AttachmentType::COLOR, colorBuffer);
+    // back end: tiles are disjoint, so depthBuffer and renderTarget are written without locks
+    tile_stats.assign(tiles_x * tiles_y, {});
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int tile = 0; tile < tiles_x * tiles_y; tile++)
+    {
+        int tx = tile % tiles_x, ty = tile / tiles_x;
+        TileRect rect = {tx * tile_size, ty * tile_size,
+                         std::min(target_width, (tx + 1) * tile_size) - 1,
+                         std::min(target_height, (ty + 1) * tile_size) - 1};
+        for (int i : tile_bins[tile])
+        {
+            if (type == AttachmentType::SHADOWMAP)
+                rasterizeDepth(raster_queue[i], *shadowmap_target, rect, shadow_slope_bias);
+            else
+                rasterize(raster_queue[i], type, renderTarget, rect, tile_stats[tile]);
+        }
+    }
+    for (auto &ts : tile_stats)
+    {
+        stats += ts;
     }
+    raster_queue.clear();
 }
 
-void Renderer::fragment_shader_color(const vec3 &P, const Triangle &t, const vec3 &bcs, TGAImage &renderTarget)
+// 屏幕空间的属性插值是仿射的，2x2 quad内相邻像素的uv差分恰好就是平面的偏导数
+static TexCoord texCoord(const AttributePlanes &attr, const vec2 &uv)
+{
+    return {uv, {attr.uv[0].dx, attr.uv[1].dx}, {attr.uv[0].dy, attr.uv[1].dy}};
+}
+
+void Renderer::fragment_shader_color(const vec3 &P, const RasterTriangle &rt, TGAImage &renderTarget)
 {
     if (P.z < depthBuffer.getElem(P.x, P.y))
     {
         depthBuffer.setElem(P.x, P.y, P.z);
-        vec2 tex_coord = {0, 0};
-        vec3 world_pos = {0, 0, 0};
-        vec3 normal_interpolated = {0, 0, 0};
-        float intensity = 0.0f;
-        for (int i = 0; i < 3; i++)
+        vec3 world_pos, normal_interpolated;
+        vec2 tex_coord;
+        rt.attr.eval(P.x, P.y, world_pos, tex_coord, normal_interpolated);
+        renderTarget.set({P.x, P.y}, unpackColor(shade(*rt.mesh, *rt.t, world_pos, texCoord(rt.attr, tex_coord), normal_interpolated)));
+    }
+}
+
+// msaa: shaded once per pixel, the color goes to every sample that passed coverage and depth test
+void Renderer::fragment_shader_msaa(int x, int y, int bit, const std::uint64_t *masks, const float (*z)[BLOCK_SIZE * BLOCK_SIZE], const RasterTriangle &rt)
+{
+    int covered = 0;
+    double cx = 0, cy = 0;
+    for (int s = 0; s < sample_rate; s++)
+    {
+        if ((masks[s] >> bit) & 1)
         {
-            world_pos = world_pos + t.vertices[i]->pos * bcs[i];
-            tex_coord = tex_coord + t.vertices[i]->tex_coord * bcs[i];
-            normal_interpolated = normal_interpolated + t.vertices[i]->norm * bcs[i];
-            // intensity = intensity + t.vertices[i]->intensity * bcs[i];
+            covered++;
+            cx += sample_pattern->offsets[s][0];
+            cy += sample_pattern->offsets[s][1];
         }
+    }
+    // 部分覆盖时像素中心可能落在三角形外，插值会外推到纹理范围之外，所以在被覆盖样本的重心处着色
+    // 全覆盖时样本偏移之和为0，就是像素中心
+    vec3 world_pos, normal_interpolated;
+    vec2 tex_coord;
+    rt.attr.eval(x + cx / (covered * SAMPLE_GRID), y + cy / (covered * SAMPLE_GRID), world_pos, tex_coord, normal_interpolated);
+    std::uint32_t color = shade(*rt.mesh, *rt.t, world_pos, texCoord(rt.attr, tex_coord), normal_interpolated);
 
-        // 必须要对normal进行插值，不然扰动就是基于面的，会出现棱角分明，而不是基于fragment的normal进行的扰动
-        // mat3 TBN = {{t.TBN[0],
-        //              t.TBN[1],
-        //              normal_interpolated.normalized()}};
+    const int plane = width * height;
+    for (int s = 0; s < sample_rate; s++)
+    {
+        if ((masks[s] >> bit) & 1)
+        {
+            depthBuffer.getData()[x + y * width + s * plane] = z[s][bit];
+            sampleBuffer.getData()[x + y * width + s * plane] = color;
+        }
+    }
+}
 
-        // 另一种方法：将u，v视作x，y，z的函数，T就是u变化最快的方向，B就是v变化最快的方向
-        // 每个fragment处的TB都是不同的，因为每个fragment处UV变化最快的方向也不同
-        // n与TB正交是切线空间的内在要求，而不是与三角形facet有关，也就是说每个fragment都会形成一个TBN frame
-        // 消除了上一种方法带来的三角形棱角
-        mat3 A = {{t.vertices[1]->pos - t.vertices[0]->pos,
-                   t.vertices[2]->pos - t.vertices[0]->pos,
-                   normal_interpolated}};
-        mat A_inv = A.invert();
-        vec3 T = A_inv * vec3(t.vertices[1]->tex_coord.x - t.vertices[0]->tex_coord.x, t.vertices[2]->tex_coord.x - t.vertices[0]->tex_coord.x, 0);
-        vec3 B = A_inv * vec3(t.vertices[1]->tex_coord.y - t.vertices[0]->tex_coord.y, t.vertices[2]->tex_coord.y - t.vertices[0]->tex_coord.y, 0);
-        mat3 TBN = {{T.normalized(),
-                     B.normalized(),
-                     normal_interpolated.normalized()}};
+void Renderer::resolve()
+{
+    const std::uint32_t *resolved = resolveBuffer.getData();
+    resolveSamples(sampleBuffer.getData(), width * height, sample_rate, resolveBuffer.getData(), simd_level);
+    const int bpp = colorBuffer.bytespp();
+    // row() detaches once here instead of inside the parallel loop
+    colorBuffer.row(0);
+#pragma omp parallel for
+    for (int y = 0; y < height; y++)
+    {
+        std::uint8_t *dst = colorBuffer.row(y);
+        for (int x = 0; x < width; x++)
+        {
+            memcpy(dst + x * bpp, unpackColor(resolved[x + y * width]).bgra, bpp);
+        }
+    }
+}
 
-        vec3 normal_gt = cur_mesh->normal(tex_coord);
-        vec3 normal_world = TBN.transpose() * normal_gt;
+void Renderer::fragment_shader_gbuffer(const vec3 &P, const RasterTriangle &rt)
+{
+    if (P.z < depthBuffer.getElem(P.x, P.y))
+    {
+        depthBuffer.setElem(P.x, P.y, P.z);
+        GBufferTexel &texel = gbuffer.getElem(P.x, P.y);
+        rt.attr.eval(P.x, P.y, texel.world_pos, texel.uv, texel.normal);
+        TexCoord tc = texCoord(rt.attr, texel.uv);
+        texel.duv_dx = tc.dx;
+        texel.duv_dy = tc.dy;
+        texel.triangle = rt.t;
+        texel.mesh = rt.mesh;
+    }
+}
 
-        // 不应该是对顶点颜色进行插值，而是应该对坐标进行插值，否则会严重降低纹理精度
-        TGAColor color = cur_mesh->texture.sample2D(tex_coord.x, tex_coord.y);
-        color = phongShader(world_pos, tex_coord, normal_world, color);
-        renderTarget.set({P.x, P.y}, color);
+std::uint32_t Renderer::shade(const Mesh &mesh, const Triangle &t, const vec3 &world_pos, const TexCoord &tex_coord, const vec3 &normal_interpolated)
+{
+    // 必须要对normal进行插值，不然扰动就是基于面的，会出现棱角分明，而不是基于fragment的normal进行的扰动
+    // mat3 TBN = {{t.TBN[0],
+    //              t.TBN[1],
+    //              normal_interpolated.normalized()}};
+
+    // 另一种方法：将u，v视作x，y，z的函数，T就是u变化最快的方向，B就是v变化最快的方向
+    // 每个fragment处的TB都是不同的，因为每个fragment处UV变化最快的方向也不同
+    // n与TB正交是切线空间的内在要求，而不是与三角形facet有关，也就是说每个fragment都会形成一个TBN frame
+    // 消除了上一种方法带来的三角形棱角
+    // 即求解 [e1; e2; n] T = [du1; du2; 0]，解为平面内的梯度沿面法线方向修正到与n正交
+    // 平面内的梯度在Mesh构建时已经算好，这里不再需要逐片元求逆
+    vec3 normal_world;
+    if (mesh.worldNormalMap.width())
+    {
+        // 静态网格可以预先把TBN乘进法线贴图
+        normal_world = mesh.worldNormalMap.sampleNormal(tex_coord, texture_filter);
     }
+    else
+    {
+        const vec3 &N = t.normal;
+        double n_dot_N = normal_interpolated * N;
+        vec3 T = t.grad_u - N * ((normal_interpolated * t.grad_u) / n_dot_N);
+        vec3 B = t.grad_v - N * ((normal_interpolated * t.grad_v) / n_dot_N);
+
+        vec3 normal_gt = mesh.normal(tex_coord, texture_filter);
+        normal_world = T.normalized() * normal_gt.x + B.normalized() * normal_gt.y + normal_interpolated.normalized() * normal_gt.z;
+    }
+
+    // 不应该是对顶点颜色进行插值，而是应该对坐标进行插值，否则会严重降低纹理精度
+    std::uint32_t color = mesh.texture->sample2D(tex_coord, texture_filter);
+    return phongShader(mesh, world_pos, tex_coord, normal_world, color);
 }
 
-void Renderer::fragment_shader_shadowmap(const vec3 &P, const Triangle &t, const vec3 &bcs, TGAImage &renderTarget)
+void Renderer::clearGBuffer()
 {
-    float cur_depth = unpack(renderTarget.get(P.x, P.y));
-    if (P.z < cur_depth)
+    if (gbuffer.getWidth() != width || gbuffer.getHeight() != height)
     {
-        renderTarget.set(P.x, P.y, pack(P.z));
+        gbuffer = Buffer<GBufferTexel>(width, height, {});
+        return;
+    }
+    GBufferTexel *texels = gbuffer.getData();
+#pragma omp parallel for
+    for (int i = 0; i < width * height; i++)
+    {
+        texels[i].triangle = nullptr;
     }
 }
 
-TGAColor Renderer::phongShader(const vec3 &fragPos, const vec2 &uv, const vec3 &normal, const TGAColor &color)
+void Renderer::shadeGBuffer()
+{
+    // 每个可见像素只着色一次，开销和分辨率成正比而不是和overdraw成正比
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const GBufferTexel &texel = gbuffer.getElem(x, y);
+            if (texel.triangle)
+            {
+                colorBuffer.set(x, y, unpackColor(shade(*texel.mesh, *texel.triangle, texel.world_pos, {texel.uv, texel.duv_dx, texel.duv_dy}, texel.normal)));
+            }
+        }
+    }
+}
+
+std::uint32_t Renderer::phongShader(const Mesh &mesh, const vec3 &fragPos, const TexCoord &uv, const vec3 &normal, const std::uint32_t color)
 {
     float ka = 0.05, kd = 0.6, ks = 0.35;
 
     float intensity = 0.0f;
-    const float epsilon = 3e-3;
 
     for (auto light : cur_scene->dirlights)
     {
         // shadow mapping
         float shadow_factor = 1.0f;
-        vec3 frag_light_coord = proj<3>(light->MVP_viewport * embed<4>(fragPos, 1.0));
-        float light_depth = unpack(light->shadowmap->get(frag_light_coord.x, frag_light_coord.y));
-        if (light_depth + epsilon < frag_light_coord.z)
+        if (!light->cascades.empty())
         {
-            shadow_factor = 0.0f;
+            // 按视线深度选cascade
+            const ShadowCascade *cascade = &light->cascades.back();
+            if (light->cascades.size() > 1)
+            {
+                double depth = -(shadow_camera_view * embed<4>(fragPos, 1.0))[2];
+                for (int i = light->cascades.size() - 1; i--;)
+                {
+                    cascade = depth <= light->cascades[i].split ? &light->cascades[i] : cascade;
+                }
+            }
+            vec3 frag_light_coord = proj<3>(cascade->MVP_viewport * embed<4>(fragPos, 1.0));
+            const Buffer<float> &shadowmap = *cascade->shadowmap;
+            if (shadow_technique == ShadowTechnique::PCF)
+                shadow_factor = shadowPCF(shadowmap.getData(), shadowmap.getWidth(), shadowmap.getHeight(),
+                                          frag_light_coord.x, frag_light_coord.y, frag_light_coord.z, cascade->bias, shadow_filter, simd_level);
+            else
+                shadow_factor = filteredShadow(*cascade, frag_light_coord);
         }
 
         vec3 h = ((camera.eye - fragPos).normalized() + light->lightDir).normalized();
-        auto spec_coef = cur_mesh->specular(uv);
-        intensity += (kd * std::max(0.0, normal * light->lightDir) + ks * std::pow(std::max(0.0, h * normal), spec_coef)) * shadow_factor;
+        auto spec_coef = mesh.specular(uv, texture_filter);
+        intensity += (kd * std::max<real>(0, normal * light->lightDir) + ks * std::pow(std::max<real>(0, h * normal), spec_coef)) * shadow_factor;
     }
 
     intensity += ambient_intensity * ka;
 
-    return color * intensity;
+    return scaleColor(color, intensity);
 }
 
-void Renderer::render(const Triangle &t, AttachmentType type, TGAImage &renderTarget)
+void Renderer::rasterize(const RasterTriangle &rt, AttachmentType type, TGAImage &renderTarget, const TileRect &rect, RasterStats &tileStats)
 {
-    vec2 bbox_min = {width - 1, height - 1};
-    vec2 bbox_max = {0, 0};
-    vec2 limits = {width - 1, height - 1};
-    vec3 pts[3];
-    for (int i = 0; i < 3; i++)
+    vec3 pts[3] = {rt.pts[0], rt.pts[1], rt.pts[2]};
+    // only the color pass is multisampled, the G-buffer keeps one sample per pixel
+    const int samples = type == AttachmentType::COLOR ? sample_rate : 1;
+    const double margin = samples > 1 ? 0.5 : 0;
+    TileRect bbox = getBBox(pts, targetWidth(type), targetHeight(type), margin);
+    bbox.x0 = std::max(bbox.x0, rect.x0);
+    bbox.y0 = std::max(bbox.y0, rect.y0);
+    bbox.x1 = std::min(bbox.x1, rect.x1);
+    bbox.y1 = std::min(bbox.y1, rect.y1);
+    if (bbox.x0 > bbox.x1 || bbox.y0 > bbox.y1)
+        return;
+
+    const bool use_hiz = hiz;
+    // 插值出的深度可能因为舍入略小于顶点深度，留一点余量保证粗剔除是保守的
+    const double zmin = std::min({pts[0].z, pts[1].z, pts[2].z}) - HIZ_EPSILON;
+    if (use_hiz)
     {
-        pts[i] = t.vertices[i]->screen_coord;
-        bbox_max.x = std::min(limits.x, std::max(bbox_max.x, pts[i].x));
-        bbox_max.y = std::min(limits.y, std::max(bbox_max.y, pts[i].y));
+        // whole triangle (or its part inside this tile) is behind everything already drawn
+        tileStats.triangles_tested++;
+        bool visible = false;
+        for (int by = bbox.y0 / BLOCK_SIZE; !visible && by <= bbox.y1 / BLOCK_SIZE; by++)
+        {
+            for (int bx = bbox.x0 / BLOCK_SIZE; !visible && bx <= bbox.x1 / BLOCK_SIZE; bx++)
+            {
+                visible = zmin < hizBuffer.getElem(bx, by);
+            }
+        }
+        if (!visible)
+        {
+            tileStats.triangles_rejected++;
+            return;
+        }
+    }
 
-        bbox_min.x = std::max(0.0, std::min(bbox_min.x, pts[i].x));
-        bbox_min.y = std::max(0.0, std::min(bbox_min.y, pts[i].y));
+    const EdgeFunctions &ef = rt.ef;
+    // msaa: the edge functions and the depth plane are moved to each sample position
+    EdgeFunctions offset_ef[MAX_SAMPLES];
+    for (int s = 0; s < samples && samples > 1; s++)
+    {
+        offset_ef[s] = ef.offset(sample_pattern->offsets[s][0], sample_pattern->offsets[s][1]);
     }
+    const EdgeFunctions *sample_ef = samples > 1 ? offset_ef : &ef;
 
-    for (int x = bbox_min.x; x <= bbox_max.x; x++)
+    // 8x8 blocks aligned to the screen grid, coverage and depth test of a whole block are evaluated at once
+    const int depth_stride = depthBuffer.getWidth();
+    const int plane = width * height;
+    float z[MAX_SAMPLES][BLOCK_SIZE * BLOCK_SIZE];
+    std::uint64_t masks[MAX_SAMPLES];
+    for (int by = bbox.y0 & ~(BLOCK_SIZE - 1); by <= bbox.y1; by += BLOCK_SIZE)
     {
-        for (int y = bbox_min.y; y <= bbox_max.y; y++)
+        int row_begin = std::max(bbox.y0 - by, 0);
+        int row_end = std::min(bbox.y1 - by, BLOCK_SIZE - 1);
+        for (int bx = bbox.x0 & ~(BLOCK_SIZE - 1); bx <= bbox.x1; bx += BLOCK_SIZE)
         {
-            // fragment shader
-            vec3 P = {x, y, 0};
-            auto bcs = getBarycentric(pts, P);
-            // std::cout << other << " " << u << " " << v << std::endl;
-            if (bcs[0] < 0 || bcs[1] < 0 || bcs[2] < 0 || bcs[0] > 1 || bcs[1] > 1 || bcs[2] > 1)
+            int col_begin = std::max(bbox.x0 - bx, 0);
+            int col_end = std::min(bbox.x1 - bx, BLOCK_SIZE - 1);
+            std::uint8_t colmask = (0xFF >> (BLOCK_SIZE - 1 - col_end)) & (0xFF << col_begin);
+            if (use_hiz)
             {
-                continue;
+                // nearest point of the depth plane over the block, but never nearer than the triangle itself
+                tileStats.blocks_tested++;
+                double x0 = bx + col_begin - margin, x1 = bx + col_end + margin, y0 = by + row_begin - margin, y1 = by + row_end + margin;
+                double plane_min = std::min(ef.Zx * x0, ef.Zx * x1) + std::min(ef.Zy * y0, ef.Zy * y1) + ef.Zc - HIZ_EPSILON;
+                if (std::max(zmin, plane_min) >= hizBuffer.getElem(bx / BLOCK_SIZE, by / BLOCK_SIZE))
+                {
+                    tileStats.blocks_rejected++;
+                    continue;
+                }
             }
-            // std::cout << pts[0] << std::endl;
-            // 因为depth仍然是一个平面三角形的属性，和对空间三角形的三个顶点的颜色进行插值需要考虑空间变换是两码事
-            for (int i = 0; i < 3; i++)
+            std::uint64_t mask = 0;
+            for (int s = 0; s < samples; s++)
             {
-                P.z += pts[i].z * bcs[i];
+                const float *depth = depthBuffer.getData() + s * plane + bx + by * depth_stride;
+                masks[s] = rasterizeBlock(sample_ef[s], bx, by, colmask, row_begin, row_end, depth, depth_stride, z[s], simd_level);
+                mask |= masks[s];
             }
-            // std::cout << P.z << std::endl;
 
-            // 对于三个坐标的点都成立的重心坐标，对于它的三个维度中的两个维度肯定是成立的
-            // 对于一点P的重心坐标又是唯一的，那么在投影平面内计算出来的重心坐标就是在空间中的重心坐标
-            if (type == AttachmentType::COLOR)
+            // only covered lanes go to the shader
+            const bool written = mask != 0;
+            while (mask)
+            {
+                int bit = __builtin_ctzll(mask);
+                mask &= mask - 1;
+                int x = bx + bit % BLOCK_SIZE, y = by + bit / BLOCK_SIZE;
+                if (samples > 1)
+                {
+                    fragment_shader_msaa(x, y, bit, masks, z, rt);
+                    continue;
+                }
+                // fragment shader
+                // 因为depth仍然是一个平面三角形的属性，和对空间三角形的三个顶点的颜色进行插值需要考虑空间变换是两码事
+                // 对于三个坐标的点都成立的重心坐标，对于它的三个维度中的两个维度肯定是成立的
+                // 对于一点P的重心坐标又是唯一的，那么在投影平面内计算出来的重心坐标就是在空间中的重心坐标
+                vec3 P = {x, y, z[0][bit]};
+                if (type == AttachmentType::COLOR)
+                {
+                    fragment_shader_color(P, rt, renderTarget);
+                }
+                else if (type == AttachmentType::GBUFFER)
+                {
+                    fragment_shader_gbuffer(P, rt);
+                }
+            }
+            if (use_hiz && written)
             {
-                fragment_shader_color(P, t, bcs, renderTarget);
+                updateHiZ(bx, by, samples);
             }
-            else if (type == AttachmentType::SHADOWMAP)
+        }
+    }
+}
+
+void Renderer::rasterizeDepth(const RasterTriangle &rt, Buffer<float> &target, const TileRect &rect, float slope_bias)
+{
+    TileRect bbox = getBBox(rt.pts, target.getWidth(), target.getHeight());
+    bbox.x0 = std::max(bbox.x0, rect.x0);
+    bbox.y0 = std::max(bbox.y0, rect.y0);
+    bbox.x1 = std::min(bbox.x1, rect.x1);
+    bbox.y1 = std::min(bbox.y1, rect.y1);
+    if (bbox.x0 > bbox.x1 || bbox.y0 > bbox.y1)
+        return;
+
+    // slope-scaled bias: the depth plane is pushed back by slope_bias times its steepest change per pixel
+    EdgeFunctions ef = rt.ef;
+    ef.Zc += slope_bias * std::max(std::abs(ef.Zx), std::abs(ef.Zy));
+
+    // 只插值深度，覆盖和深度测试之后直接写回，不经过fragment shader
+    const int stride = target.getWidth();
+    for (int by = bbox.y0 & ~(BLOCK_SIZE - 1); by <= bbox.y1; by += BLOCK_SIZE)
+    {
+        int row_begin = std::max(bbox.y0 - by, 0);
+        int row_end = std::min(bbox.y1 - by, BLOCK_SIZE - 1);
+        for (int bx = bbox.x0 & ~(BLOCK_SIZE - 1); bx <= bbox.x1; bx += BLOCK_SIZE)
+        {
+            int col_begin = std::max(bbox.x0 - bx, 0);
+            int col_end = std::min(bbox.x1 - bx, BLOCK_SIZE - 1);
+            std::uint8_t colmask = (0xFF >> (BLOCK_SIZE - 1 - col_end)) & (0xFF << col_begin);
+            rasterizeDepthBlock(ef, bx, by, colmask, row_begin, row_end, target.getData() + bx + by * stride, stride, simd_level);
+        }
+    }
+}
+
+void Renderer::updateHiZ(int bx, int by, int samples)
+{
+    const int cols = std::min(BLOCK_SIZE, width - bx);
+    const int rows = std::min(BLOCK_SIZE, height - by);
+    float zmax = 0;
+    for (int s = 0; s < samples; s++)
+    {
+        for (int y = by; y < by + rows; y++)
+        {
+            const float *row = depthBuffer.getData() + bx + (y + s * height) * width;
+            for (int x = 0; x < cols; x++)
             {
-                fragment_shader_shadowmap(P, t, bcs, renderTarget);
+                zmax = row[x] > zmax ? row[x] : zmax;
             }
         }
     }
+    hizBuffer.setElem(bx / BLOCK_SIZE, by / BLOCK_SIZE, zmax);
 }
 
 vec4 Renderer::sample2D(const TGAImage &texture, const float &u, const float &v)
@@ -282,8 +962,8 @@ void Renderer::triangle(vec2 *pts, TGAImage &image, vec4 *colors)
         bbox_max.x = std::min(limits.x, std::max(bbox_max.x, pts[i].x));
         bbox_max.y = std::min(limits.y, std::max(bbox_max.y, pts[i].y));
 
-        bbox_min.x = std::max(0.0, std::min(bbox_min.x, pts[i].x));
-        bbox_min.y = std::max(0.0, std::min(bbox_min.y, pts[i].y));
+        bbox_min.x = std::max<real>(0, std::min(bbox_min.x, pts[i].x));
+        bbox_min.y = std::max<real>(0, std::min(bbox_min.y, pts[i].y));
     }
 
     // std::cout << "min: " << bbox_min << std::endl;
@@ -330,8 +1010,8 @@ void Renderer::triangle(vec3 *pts, TGAImage &image, vec4 *colors)
         bbox_max.x = std::min(limits.x, std::max(bbox_max.x, pts[i].x));
         bbox_max.y = std::min(limits.y, std::max(bbox_max.y, pts[i].y));
 
-        bbox_min.x = std::max(0.0, std::min(bbox_min.x, pts[i].x));
-        bbox_min.y = std::max(0.0, std::min(bbox_min.y, pts[i].y));
+        bbox_min.x = std::max<real>(0, std::min(bbox_min.x, pts[i].x));
+        bbox_min.y = std::max<real>(0, std::min(bbox_min.y, pts[i].y));
     }
 
     // std::cout << "min: " << bbox_min << std::endl;
@@ -4,27 +4,155 @@
 #include "geometry.h"
 #include "buffer.hpp"
 #include "scene.h"
+#include "rasterizer.h"
+#include "frame_stream.h"
 // #include "transforms.hpp"
 #include <string>
 
+enum class CullMode
+{
+    NONE,
+    BACK,
+    FRONT
+};
+
+// how phongShader turns the shadow maps into a shadow factor
+enum class ShadowTechnique
+{
+    // depth compare, filtered with ShadowFilter
+    PCF,
+    // exponential shadow maps, prefiltered exp(c * depth)
+    ESM,
+    // variance shadow maps, prefiltered depth and depth^2
+    VSM
+};
+
 enum class AttachmentType
 {
     COLOR,
+    GBUFFER,
     SHADOWMAP
 };
 
+// attributes of the nearest fragment of a pixel, shaded once in the deferred pass
+struct GBufferTexel
+{
+    vec3 world_pos;
+    vec2 uv;
+    // screen-space derivatives of uv, for mip selection
+    vec2 duv_dx, duv_dy;
+    vec3 normal;
+    // triangle id, nullptr where nothing was drawn
+    const Triangle *triangle = nullptr;
+    const Mesh *mesh = nullptr;
+};
+
+// triangle handed from primitive assembly to the rasterizer, screen coords are copied
+// so that the mesh can be re-transformed while binned triangles are still pending
+struct RasterTriangle
+{
+    const Triangle *t;
+    const Mesh *mesh;
+    vec3 pts[3];
+    // a clipped triangle is part of t, its corners are given as barycentrics of t
+    bool clipped = false;
+    vec3 bary[3];
+    // triangle setup, done once before binning
+    bool valid = false;
+    EdgeFunctions ef;
+    AttributePlanes attr;
+};
+
+// primitive assembly and hierarchical-z counters, the hiz triangle test runs once per tile a triangle was binned into
+struct RasterStats
+{
+    long long triangles_backface_culled = 0;
+    long long triangles_frustum_culled = 0;
+    long long triangles_clipped = 0;
+    long long triangles_tested = 0;
+    long long triangles_rejected = 0;
+    long long blocks_tested = 0;
+    long long blocks_rejected = 0;
+
+    RasterStats &operator+=(const RasterStats &rhs)
+    {
+        triangles_backface_culled += rhs.triangles_backface_culled;
+        triangles_frustum_culled += rhs.triangles_frustum_culled;
+        triangles_clipped += rhs.triangles_clipped;
+        triangles_tested += rhs.triangles_tested;
+        triangles_rejected += rhs.triangles_rejected;
+        blocks_tested += rhs.blocks_tested;
+        blocks_rejected += rhs.blocks_rejected;
+        return *this;
+    }
+};
+
+// inclusive pixel rectangle
+struct TileRect
+{
+    int x0, y0, x1, y1;
+};
+
 class Renderer
 {
+    // one width x height plane per sample, stacked vertically
     Buffer<float> depthBuffer;
+    // max depth over all samples of every 8x8 pixel block
+    Buffer<float> hizBuffer;
     TGAImage colorBuffer;
+    // packed bgra colors of every sample, resolved into colorBuffer, only used with more than one sample
+    Buffer<std::uint32_t> sampleBuffer;
+    // resolved color of every pixel, kept between frames like sampleBuffer, empty without msaa
+    Buffer<std::uint32_t> resolveBuffer;
+    Buffer<GBufferTexel> gbuffer;
+    bool deferred = false;
     const Scene *cur_scene;
-    const Mesh *cur_mesh;
     Camera camera;
+    // msaa samples per pixel: 1, 2, 4 or 8
     int sample_rate;
+    const SamplePattern *sample_pattern;
     int width;
     int height;
 
-    int shadowmap_resolution = 1024;
+    // per cascade, the maps are fitted to the scene so far fewer texels are needed than with a fixed volume
+    int shadowmap_resolution = 512;
+    int shadow_cascades = 1;
+    // constant bias in world units, applied at lookup
+    double shadow_bias = 0.02;
+    // slope-scaled bias applied while rasterizing, in multiples of the steepest depth change per texel
+    float shadow_slope_bias = 0;
+    // FRONT renders only the back faces of closed meshes into the shadow map, which keeps acne off lit surfaces
+    CullMode shadow_cull_mode = CullMode::NONE;
+    // world to camera view, for picking the cascade of a fragment
+    mat4 shadow_camera_view;
+    ShadowFilter shadow_filter = ShadowFilter::NONE;
+    ShadowTechnique shadow_technique = ShadowTechnique::PCF;
+    // ESM and VSM: the moments are blurred once per shadow map, a fragment does a single bilinear fetch whatever the penumbra
+    int shadow_blur_radius = 2;
+    // ESM sharpness, exp(c * depth) must stay finite in float for depth up to zDepth
+    float esm_exponent = 80;
+    // shadow map written by the SHADOWMAP pass, the render target passed to flush is not used by it
+    Buffer<float> *shadowmap_target = nullptr;
+    // raster state of the shadow pass changed, cached shadow maps are stale
+    bool shadow_dirty = false;
+
+    // tile binning, every tile owns its pixels so tiles can be rasterized in parallel without locks
+    bool tiled = true;
+    int tile_size = 32;
+    std::vector<RasterTriangle> raster_queue;
+    // per-pass vertex stage output
+    TransformedVertices camera_vertices;
+    TransformedVertices light_vertices;
+    std::vector<std::vector<int>> tile_bins;
+    std::vector<RasterStats> tile_stats;
+    RasterStats stats;
+    bool hiz = true;
+    CullMode cull_mode = CullMode::BACK;
+    // -1 when the projection maps points in front of the camera to w < 0
+    double clip_sign = 1;
+    SimdLevel simd_level = detectSimdLevel();
+
+    TextureFilter texture_filter = TextureFilter::NEAREST;
 
     float ambient_intensity = 10;
     float zDepth;
@@ -40,9 +168,13 @@ public:
     Renderer(int _width, int _height, int _sample_rate = 1, float _zDepth = 1.0)
         : width(_width),
           height(_height),
-          sample_rate(_sample_rate),
-          depthBuffer(_width * _sample_rate, _height * _sample_rate, 1.0),
+          sample_pattern(&getSamplePattern(_sample_rate)),
+          sample_rate(getSamplePattern(_sample_rate).count),
+          depthBuffer(_width, _height * getSamplePattern(_sample_rate).count, 1.0),
+          hizBuffer((_width + BLOCK_SIZE - 1) / BLOCK_SIZE, (_height + BLOCK_SIZE - 1) / BLOCK_SIZE, 1.0),
           colorBuffer(_width, _height, TGAImage::RGB),
+          sampleBuffer(_width, getSamplePattern(_sample_rate).count > 1 ? _height * getSamplePattern(_sample_rate).count : 0, 0),
+          resolveBuffer(_width, getSamplePattern(_sample_rate).count > 1 ? _height : 0, 0),
           zDepth(_zDepth) {}
     vec3 getBarycentric(vec2 p0, vec2 p1, vec2 p2, const vec2 &P);
     vec3 getBarycentric(vec3 *pts, const vec3 &P);
@@ -58,17 +190,77 @@ public:
     void setCamera(const Camera _camera) { camera = _camera; }
     vec4 sample2D(const TGAImage &texture, const float &u, const float &v);
     void render(const Scene &scene);
-    void render(std::shared_ptr<Mesh> mesh, const Scene &scene);
+    void render(std::shared_ptr<const Mesh> mesh, const Scene &scene);
 
-    void render(const Triangle &t, AttachmentType type, TGAImage &renderTarget);
-    TGAColor phongShader(const vec3 &fragPos, const vec2 &uv, const vec3 &normal, const TGAColor &color);
-    void fragment_shader_color(const vec3 &P, const Triangle &t, const vec3 &bcs, TGAImage &renderTarget);
-    void fragment_shader_shadowmap(const vec3 &P, const Triangle &t, const vec3 &bcs, TGAImage &renderTarget);
+    void setTiled(bool _tiled) { tiled = _tiled; }
+    // tiles must not share an 8x8 block, or two threads would test and write the same depth and hiz entries,
+    // so the size is clamped to [BLOCK_SIZE, 4096] and rounded up to a multiple of BLOCK_SIZE
+    void setTileSize(int _tile_size) { tile_size = (std::clamp(_tile_size, BLOCK_SIZE, 4096) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE; }
+    void setSimdLevel(SimdLevel level) { simd_level = level; }
+    void setHiZ(bool _hiz) { hiz = _hiz; }
+    void setCullMode(CullMode mode) { cull_mode = mode; }
+    // in deferred mode render(mesh) only fills the G-buffer, shadeGBuffer() shades it
+    void setDeferred(bool _deferred) { deferred = _deferred; }
+    void setTextureFilter(TextureFilter filter) { texture_filter = filter; }
+    void setShadowFilter(ShadowFilter filter) { shadow_filter = filter; }
+    void setShadowTechnique(ShadowTechnique technique, int blur_radius = 2)
+    {
+        shadow_technique = technique;
+        shadow_blur_radius = blur_radius;
+        shadow_dirty = true;
+    }
+    void setShadowResolution(int resolution) { shadowmap_resolution = resolution; }
+    void setShadowBias(double bias, float slope_bias)
+    {
+        shadow_bias = bias;
+        shadow_slope_bias = slope_bias;
+        shadow_dirty = true;
+    }
+    void setShadowCullMode(CullMode mode)
+    {
+        shadow_cull_mode = mode;
+        shadow_dirty = true;
+    }
+    // 1 fits a single map to the whole scene, 2 to 4 split the view depth the scene occupies
+    void setShadowCascades(int count) { shadow_cascades = std::clamp(count, 1, MAX_SHADOW_CASCADES); }
+    const RasterStats &getStats() const { return stats; }
+    void resetStats() { stats = {}; }
+    void transformVertices(const Mesh &mesh, const mat4 &clip, const mat4 &viewport, TransformedVertices &out);
+    void enqueue(const Mesh &mesh, const TransformedVertices &verts, const mat4 &viewport, CullMode cull);
+    // pixel size of what a pass writes, shadow maps need not match the viewport
+    int targetWidth(AttachmentType type) const { return type == AttachmentType::SHADOWMAP ? shadowmap_target->getWidth() : width; }
+    int targetHeight(AttachmentType type) const { return type == AttachmentType::SHADOWMAP ? shadowmap_target->getHeight() : height; }
+    void flush(AttachmentType type, TGAImage &renderTarget);
+    void rasterize(const RasterTriangle &rt, AttachmentType type, TGAImage &renderTarget, const TileRect &rect, RasterStats &tileStats);
+    // depth-only path of the shadow pass: no attributes, no fragment shader, z is written straight to target
+    void rasterizeDepth(const RasterTriangle &rt, Buffer<float> &target, const TileRect &rect, float slope_bias);
+    void updateHiZ(int bx, int by, int samples);
+    // shadow factor of a fragment at light space coordinate p from the moments of a cascade
+    float filteredShadow(const ShadowCascade &cascade, const vec3 &p) const;
+    void buildShadowMoments(ShadowCascade &cascade);
+    std::uint32_t phongShader(const Mesh &mesh, const vec3 &fragPos, const TexCoord &uv, const vec3 &normal, const std::uint32_t color);
+    std::uint32_t shade(const Mesh &mesh, const Triangle &t, const vec3 &world_pos, const TexCoord &tex_coord, const vec3 &normal_interpolated);
+    void setup(RasterTriangle &rt, AttachmentType type);
+    void fragment_shader_color(const vec3 &P, const RasterTriangle &rt, TGAImage &renderTarget);
+    void fragment_shader_msaa(int x, int y, int bit, const std::uint64_t *masks, const float (*z)[BLOCK_SIZE * BLOCK_SIZE], const RasterTriangle &rt);
+    void resolve();
+    void fragment_shader_gbuffer(const vec3 &P, const RasterTriangle &rt);
+    void clearGBuffer();
+    void shadeGBuffer();
     void generateShadowMap(const Scene &scene);
 
     void drawAxis();
 
-    void write_tga_file(const std::string &path) { colorBuffer.write_tga_file(path); }
+    // the format follows the extension, .qoi for QOI, rle tga otherwise
+    void write_tga_file(const std::string &path)
+    {
+        if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".qoi") == 0)
+            colorBuffer.write_qoi_file(path);
+        else
+            colorBuffer.write_tga_file(path);
+    }
+    // appends the color buffer to a stream of frames for a video encoder
+    bool write_frame(FrameStream &stream) { return stream.write(colorBuffer); }
 };
 
 void line(int x0, int y0, int x1, int y1, TGAImage &image, const TGAColor &color);
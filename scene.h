@@ -1,48 +1,78 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <vector>
+#include "buffer.hpp"
 #include "model.h"
+#include "texture_pool.h"
 
 struct Vertex
 {
     vec3 pos;
     vec3 norm;
     vec2 tex_coord;
-    vec3 screen_coord;
 };
 
 struct Triangle
 {
     Vertex *vertices[3];
+    // indices of the vertices, for the per-pass transformed vertex buffers
+    int indices[3];
     mat3 TBN;
     vec3 normal;
+    // gradients of u and v inside the triangle plane
+    vec3 grad_u;
+    vec3 grad_v;
 };
 
 class Mesh
 {
 public:
     std::vector<Vertex> vertices;
+    // structure of arrays copy of vertices[i].pos, the only attribute the vertex stage reads, see updatePositions()
+    std::vector<float> pos_x, pos_y, pos_z;
     std::vector<Triangle> triangles;
-    TGAImage texture;
-    TGAImage normalMap;
-    TGAImage specularMap;
+    // bounds of the vertex positions, see updatePositions()
+    vec3 bbox_min, bbox_max;
+    // shared with every other mesh using the same images
+    TextureHandle texture;
+    // tangent space
+    TextureHandle normalMap;
+    TextureHandle specularMap;
+    // normalMap already rotated to world space by bakeNormalMap(), empty unless baked
+    Texture worldNormalMap;
 
     Mesh(std::shared_ptr<Model> model)
     {
-        vertices.resize(model->nverts());
+        // 每个不同的(位置, uv, 法线)组合一个顶点，uv接缝上的顶点要拆开，否则共享的顶点只保留最后一个面的uv
+        std::map<std::array<int, 3>, int> vert_keys;
+        std::vector<int> corners(model->nfaces() * 3);
+        for (int i = 0; i < model->nfaces() * 3; i++)
+        {
+            std::array<int, 3> key = {model->facet_vrt[i], model->facet_tex[i], model->facet_nrm[i]};
+            auto it = vert_keys.emplace(key, (int)vertices.size());
+            if (it.second)
+            {
+                Vertex vertex;
+                vertex.pos = model->vert(i / 3, i % 3);
+                vertex.tex_coord = model->uv(i / 3, i % 3);
+                vertex.norm = model->normal(i / 3, i % 3);
+                vertices.push_back(vertex);
+            }
+            corners[i] = it.first->second;
+        }
         for (int i = 0; i < model->nfaces(); i++)
         {
             Triangle t;
             for (int j = 0; j < 3; j++)
             {
-                Vertex vertex;
-                auto vert_key = model->facet_vrt[i * 3 + j];
-                vertex.pos = model->vert(i, j);
-                vertex.tex_coord = model->uv(i, j);
-                vertex.norm = model->normal(i, j);
-                vertices[vert_key] = vertex;
-                t.vertices[j] = &vertices[vert_key];
+                t.indices[j] = corners[i * 3 + j];
+                t.vertices[j] = &vertices[t.indices[j]];
             }
             // face normal
             t.normal = ((t.vertices[1]->pos - t.vertices[0]->pos) ^ (t.vertices[2]->pos - t.vertices[0]->pos)).normalized();
@@ -57,21 +87,145 @@ public:
             t.TBN = {{TB[0].normalized(), TB[1].normalized(), t.normal}};
             triangles.emplace_back(t);
         }
+        updatePositions();
+        for (auto &t : triangles)
+        {
+            // u, v的梯度：满足 e1 * grad = du1, e2 * grad = du2 且位于三角形平面内的解
+            // grad = E^T (E E^T)^-1 du，片元阶段只需把它投影到与插值法线正交的方向
+            vec3 e1 = t.vertices[1]->pos - t.vertices[0]->pos;
+            vec3 e2 = t.vertices[2]->pos - t.vertices[0]->pos;
+            vec2 duv1 = t.vertices[1]->tex_coord - t.vertices[0]->tex_coord;
+            vec2 duv2 = t.vertices[2]->tex_coord - t.vertices[0]->tex_coord;
+            mat2 gram = {{{e1 * e1, e1 * e2}, {e1 * e2, e2 * e2}}};
+            mat2 gram_inv = gram.invert();
+            vec2 du = gram_inv * vec2{duv1.x, duv2.x};
+            vec2 dv = gram_inv * vec2{duv1.y, duv2.y};
+            t.grad_u = e1 * du.x + e2 * du.y;
+            t.grad_v = e1 * dv.x + e2 * dv.y;
+        }
         texture = model->diffuse();
-        normalMap = model->normalmap;
-        specularMap = model->specularmap;
+        normalMap = model->normalMap();
+        specularMap = model->specular();
     }
 
-    vec3 normal(const vec2 &uvf) const
+    // vertices[i].pos is only read through the copies in pos_x, pos_y and pos_z and through bbox_min/bbox_max,
+    // call this after editing the positions in place, before Scene::invalidate()
+    void updatePositions()
     {
-        TGAColor c = normalMap.sample2D(uvf[0], uvf[1]);
-        return vec3{(double)c[2], (double)c[1], (double)c[0]} * 2. / 255. - vec3{1, 1, 1};
+        pos_x.resize(vertices.size());
+        pos_y.resize(vertices.size());
+        pos_z.resize(vertices.size());
+        bbox_min = bbox_max = vertices.empty() ? vec3{0, 0, 0} : vertices[0].pos;
+        for (int i = 0; i < (int)vertices.size(); i++)
+        {
+            const vec3 &p = vertices[i].pos;
+            pos_x[i] = p.x;
+            pos_y[i] = p.y;
+            pos_z[i] = p.z;
+            for (int k = 0; k < 3; k++)
+            {
+                bbox_min[k] = std::min(bbox_min[k], p[k]);
+                bbox_max[k] = std::max(bbox_max[k], p[k]);
+            }
+        }
     }
 
-    float specular(const vec2 &uv) const
+    // unit tangent space normal
+    vec3 normal(const TexCoord &tc, TextureFilter filter = TextureFilter::NEAREST) const
     {
-        TGAColor c = specularMap.sample2D(uv.x, uv.y);
-        return c[0];
+        return normalMap->sampleNormal(tc, filter);
+    }
+
+    // for static meshes: applies the per-fragment TBN of the shader to every texel of normalMap once,
+    // the shader then reads world space normals from worldNormalMap
+    // texels are assigned to the triangle covering their center in uv space, so the uv layout must not overlap,
+    // returns false and leaves worldNormalMap empty if it does (mirrored or shared uv islands)
+    bool bakeNormalMap()
+    {
+        const int w = normalMap->width(), h = normalMap->height();
+        if (!w || !h)
+            return false;
+        std::vector<vec3f> baked(w * h, {0, 0, 0});
+        std::vector<char> covered(w * h, 0);
+        long long texels = 0, overlapped = 0;
+        for (auto &t : triangles)
+        {
+            // texel centers on the integer grid
+            vec2 p[3];
+            for (int k = 0; k < 3; k++)
+            {
+                p[k] = {t.vertices[k]->tex_coord.x * w - 0.5, t.vertices[k]->tex_coord.y * h - 0.5};
+            }
+            double area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x);
+            if (area == 0)
+                continue;
+            int x0 = std::max(0, (int)std::ceil(std::min({p[0].x, p[1].x, p[2].x})));
+            int x1 = std::min(w - 1, (int)std::floor(std::max({p[0].x, p[1].x, p[2].x})));
+            int y0 = std::max(0, (int)std::ceil(std::min({p[0].y, p[1].y, p[2].y})));
+            int y1 = std::min(h - 1, (int)std::floor(std::max({p[0].y, p[1].y, p[2].y})));
+            for (int y = y0; y <= y1; y++)
+            {
+                for (int x = x0; x <= x1; x++)
+                {
+                    real b[3];
+                    for (int k = 0; k < 3; k++)
+                    {
+                        const vec2 &a = p[(k + 1) % 3], &c = p[(k + 2) % 3];
+                        b[k] = ((a.x - x) * (c.y - y) - (a.y - y) * (c.x - x)) / area;
+                    }
+                    if (b[0] < 0 || b[1] < 0 || b[2] < 0)
+                        continue;
+                    // a texel center exactly on a shared edge is claimed by both triangles, that is not an overlap,
+                    // strictly inside claims of an already covered texel are, a 1% tolerance is left for rounding
+                    if (covered[x + y * w] && b[0] > 0 && b[1] > 0 && b[2] > 0)
+                        overlapped++;
+                    // 与Renderer::shade中逐片元的TBN相同
+                    vec3 n = t.vertices[0]->norm * b[0] + t.vertices[1]->norm * b[1] + t.vertices[2]->norm * b[2];
+                    const vec3 &N = t.normal;
+                    vec3 T = t.grad_u - N * ((n * t.grad_u) / (n * N));
+                    vec3 B = t.grad_v - N * ((n * t.grad_v) / (n * N));
+                    vec3f ng = normalMap->fetchNormal(x, y);
+                    vec3 world = T.normalized() * ng.x + B.normalized() * ng.y + n.normalized() * ng.z;
+                    baked[x + y * w] = {float(world.x), float(world.y), float(world.z)};
+                    texels += !covered[x + y * w];
+                    covered[x + y * w] = 1;
+                }
+            }
+        }
+        if (overlapped * 100 > texels)
+            return false;
+        // 把uv岛向外扩几个texel，边缘的片元和双线性过滤会取到岛外的texel
+        for (int pass = 0; pass < 4; pass++)
+        {
+            std::vector<char> next = covered;
+            for (int y = 0; y < h; y++)
+            {
+                for (int x = 0; x < w; x++)
+                {
+                    if (covered[x + y * w])
+                        continue;
+                    vec3f sum = {0, 0, 0};
+                    const int nx[4] = {x - 1, x + 1, x, x}, ny[4] = {y, y, y - 1, y + 1};
+                    for (int k = 0; k < 4; k++)
+                    {
+                        if (nx[k] >= 0 && ny[k] >= 0 && nx[k] < w && ny[k] < h && covered[nx[k] + ny[k] * w])
+                        {
+                            sum = sum + baked[nx[k] + ny[k] * w];
+                            next[x + y * w] = 1;
+                        }
+                    }
+                    baked[x + y * w] = sum;
+                }
+            }
+            covered.swap(next);
+        }
+        worldNormalMap = Texture::fromNormals(w, h, baked, normalMap->getLayout());
+        return true;
+    }
+
+    float specular(const TexCoord &tc, TextureFilter filter = TextureFilter::NEAREST) const
+    {
+        return specularMap->sample2D(tc, filter) & 0xFF;
     }
 };
 
@@ -82,6 +236,23 @@ struct Camera
     vec3 up;
 };
 
+constexpr int MAX_SHADOW_CASCADES = 4;
+
+// shadow map of one slice of the camera's view depth, fitted to the part of the scene inside the slice
+struct ShadowCascade
+{
+    std::shared_ptr<Buffer<float>> shadowmap;
+    // blurred moments of the depth for the filtered shadow techniques: exp(c * depth) for ESM, depth and depth^2 for VSM
+    Buffer<float> moments[2];
+    mat4 MVP_viewport;
+    // fragments up to this camera view depth are looked up in this cascade
+    double split = 0;
+    // depth bias in shadow map depth units, the depth range differs per cascade
+    float bias = 0;
+    // Scene::generation the shadow map was rendered at, it is reused while this and MVP_viewport stay the same
+    std::uint64_t generation = 0;
+};
+
 struct Light
 {
     enum class Type
@@ -90,11 +261,11 @@ struct Light
         PointLight
     };
     Type type;
-    std::shared_ptr<TGAImage> shadowmap;
-    mat4 MVP_viewport;
+    // ordered by view depth, written by Renderer::generateShadowMap
+    std::vector<ShadowCascade> cascades;
     vec3 intensity;
     Light() = default;
-    Light(const vec3 _intensity, std::shared_ptr<TGAImage> _shadowmap, Type _type) : intensity(_intensity), shadowmap(_shadowmap), type(_type) {}
+    Light(const vec3 _intensity, Type _type) : intensity(_intensity), type(_type) {}
 
     virtual void dummyFunc() {}
 };
@@ -103,8 +274,8 @@ struct DirectionalLight : public Light
 {
     vec3 lightDir;
     DirectionalLight() = default;
-    DirectionalLight(const vec3 &_lightDir, const vec3 _intensity = {1, 1, 1}, std::shared_ptr<TGAImage> _shadowmap = nullptr)
-        : lightDir(_lightDir.normalized()), Light(_intensity, _shadowmap, Type::DirectionalLight) {}
+    DirectionalLight(const vec3 &_lightDir, const vec3 _intensity = {1, 1, 1})
+        : lightDir(_lightDir.normalized()), Light(_intensity, Type::DirectionalLight) {}
 };
 
 struct PointLight : public Light
@@ -117,6 +288,20 @@ public:
     std::vector<std::shared_ptr<Model>> models;
     std::vector<std::shared_ptr<Mesh>> meshes;
     std::vector<std::shared_ptr<DirectionalLight>> dirlights;
+    // renewed whenever the geometry changes, cached shadow maps of an older generation are rendered again
+    // drawn from one process wide counter, a light shared by two scenes never sees the same value for both
+    std::uint64_t generation = nextGeneration();
+
+    // meshes are edited in place through their public members, call this afterwards
+    // (and Mesh::updatePositions() first if vertex positions changed)
+    void invalidate() { generation = nextGeneration(); }
+
+    static std::uint64_t nextGeneration()
+    {
+        // 0 is what an unrendered ShadowCascade holds
+        static std::atomic<std::uint64_t> counter{1};
+        return counter.fetch_add(1, std::memory_order_relaxed);
+    }
 
     void addModel(std::shared_ptr<Model> model)
     {
@@ -126,11 +311,27 @@ public:
     void addMesh(std::shared_ptr<Mesh> &mesh)
     {
         meshes.push_back(std::move(mesh));
+        invalidate();
     }
 
     void addMesh(std::shared_ptr<Mesh> &&mesh)
     {
         meshes.push_back(std::move(mesh));
+        invalidate();
+    }
+
+    // bounds of all meshes, false if there are none, up to date once every edited mesh called updatePositions()
+    bool bounds(vec3 &bbox_min, vec3 &bbox_max) const
+    {
+        for (int i = 0; i < (int)meshes.size(); i++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                bbox_min[k] = i ? std::min(bbox_min[k], meshes[i]->bbox_min[k]) : meshes[i]->bbox_min[k];
+                bbox_max[k] = i ? std::max(bbox_max[k], meshes[i]->bbox_max[k]) : meshes[i]->bbox_max[k];
+            }
+        }
+        return !meshes.empty();
     }
 
     void addLight(std::shared_ptr<Light> light)
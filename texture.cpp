@@ -0,0 +1,256 @@
+#include "texture.h"
+#include <algorithm>
+#include <cmath>
+
+static vec3f toFloat(const vec3 &v)
+{
+    return {float(v.x), float(v.y), float(v.z)};
+}
+
+static vec3f normalizedOrZ(const vec3f &v)
+{
+    float len = v.norm();
+    return len > 0 ? v / len : vec3f{0, 0, 1};
+}
+
+Texture::Texture(const TGAImage &image, TextureFormat _format, TextureLayout _layout)
+    : w(image.width()), h(image.height()), format(_format), layout(_layout)
+{
+    if (w <= 0 || h <= 0)
+    {
+        w = h = 0;
+        return;
+    }
+
+    std::size_t texels = allocate();
+    const Level &base = levels[0];
+    if (format == TextureFormat::NORMAL)
+    {
+        normals.assign(texels, {0, 0, 0});
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                normals[address(base, x, y)] = normalizedOrZ(toFloat(decodeNormal(image.get(x, y))));
+            }
+        }
+        buildNormalMips();
+        return;
+    }
+
+    data.assign(texels, 0);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            data[address(base, x, y)] = packColor(image.get(x, y));
+        }
+    }
+
+    // 2x2 box filter, the last row or column of an odd sized level is used twice
+    for (int l = 1; l < (int)levels.size(); l++)
+    {
+        const Level &src = levels[l - 1], &dst = levels[l];
+        for (int y = 0; y < dst.h; y++)
+        {
+            int y0 = std::min(2 * y, src.h - 1), y1 = std::min(2 * y + 1, src.h - 1);
+            for (int x = 0; x < dst.w; x++)
+            {
+                int x0 = std::min(2 * x, src.w - 1), x1 = std::min(2 * x + 1, src.w - 1);
+                std::uint32_t c[4] = {data[address(src, x0, y0)], data[address(src, x1, y0)], data[address(src, x0, y1)], data[address(src, x1, y1)]};
+                std::uint32_t ret = 0;
+                for (int i = 0; i < 32; i += 8)
+                {
+                    std::uint32_t sum = ((c[0] >> i) & 0xFF) + ((c[1] >> i) & 0xFF) + ((c[2] >> i) & 0xFF) + ((c[3] >> i) & 0xFF);
+                    ret |= ((sum + 2) >> 2) << i;
+                }
+                data[address(dst, x, y)] = ret;
+            }
+        }
+    }
+}
+
+Texture Texture::fromNormals(int w, int h, const std::vector<vec3f> &normals, TextureLayout layout)
+{
+    Texture ret;
+    if (w <= 0 || h <= 0)
+        return ret;
+    ret.w = w;
+    ret.h = h;
+    ret.format = TextureFormat::NORMAL;
+    ret.layout = layout;
+    ret.normals.assign(ret.allocate(), {0, 0, 0});
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            ret.normals[ret.address(ret.levels[0], x, y)] = normalizedOrZ(normals[x + y * w]);
+        }
+    }
+    ret.buildNormalMips();
+    return ret;
+}
+
+bool Texture::matches(const TGAImage &image) const
+{
+    if (image.width() != w || image.height() != h)
+        return false;
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            if (format == TextureFormat::NORMAL)
+            {
+                vec3f n = fetchNormal(x, y), m = normalizedOrZ(toFloat(decodeNormal(image.get(x, y))));
+                if (n.x != m.x || n.y != m.y || n.z != m.z)
+                    return false;
+            }
+            else if (fetch(x, y) != packColor(image.get(x, y)))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+std::size_t Texture::allocate()
+{
+    // sizes of all levels first, the texel array must not move while the chain is filled
+    std::size_t texels = 0;
+    levels.clear();
+    for (int lw = w, lh = h;; lw = std::max(1, lw / 2), lh = std::max(1, lh / 2))
+    {
+        // the last row and column of tiles are padded
+        Level level = {lw, lh, (lw + TILE_SIZE - 1) / TILE_SIZE, texels};
+        levels.push_back(level);
+        texels += texelCount(level);
+        if (lw == 1 && lh == 1)
+            break;
+    }
+    return texels;
+}
+
+// 先解码再做box filter并重新归一化，比先对字节取平均再解码更准确
+void Texture::buildNormalMips()
+{
+    for (int l = 1; l < (int)levels.size(); l++)
+    {
+        const Level &src = levels[l - 1], &dst = levels[l];
+        for (int y = 0; y < dst.h; y++)
+        {
+            int y0 = std::min(2 * y, src.h - 1), y1 = std::min(2 * y + 1, src.h - 1);
+            for (int x = 0; x < dst.w; x++)
+            {
+                int x0 = std::min(2 * x, src.w - 1), x1 = std::min(2 * x + 1, src.w - 1);
+                vec3f sum = normals[address(src, x0, y0)] + normals[address(src, x1, y0)] + normals[address(src, x0, y1)] + normals[address(src, x1, y1)];
+                normals[address(dst, x, y)] = normalizedOrZ(sum);
+            }
+        }
+    }
+}
+
+std::size_t Texture::texelCount(const Level &level) const
+{
+    if (layout == TextureLayout::LINEAR)
+        return std::size_t(level.w) * level.h;
+    int tiles_y = (level.h + TILE_SIZE - 1) / TILE_SIZE;
+    return std::size_t(level.tiles_x) * tiles_y * TILE_SIZE * TILE_SIZE;
+}
+
+float Texture::lod(const TexCoord &tc) const
+{
+    float dx = std::hypot(tc.dx.x * w, tc.dx.y * h);
+    float dy = std::hypot(tc.dy.x * w, tc.dy.y * h);
+    float rho = std::max(dx, dy);
+    return rho > 0 ? std::log2(rho) : 0.0f;
+}
+
+void Texture::bilinear(const Level &level, const vec2 &uv, float *out) const
+{
+    float x = uv.x * level.w - 0.5f, y = uv.y * level.h - 0.5f;
+    float fx = std::floor(x), fy = std::floor(y);
+    float ax = x - fx, ay = y - fy;
+    int x0 = std::clamp(int(fx), 0, level.w - 1), x1 = std::clamp(int(fx) + 1, 0, level.w - 1);
+    int y0 = std::clamp(int(fy), 0, level.h - 1), y1 = std::clamp(int(fy) + 1, 0, level.h - 1);
+    std::uint32_t c00 = data[address(level, x0, y0)], c10 = data[address(level, x1, y0)];
+    std::uint32_t c01 = data[address(level, x0, y1)], c11 = data[address(level, x1, y1)];
+    for (int i = 0; i < 4; i++)
+    {
+        float v00 = (c00 >> (8 * i)) & 0xFF, v10 = (c10 >> (8 * i)) & 0xFF;
+        float v01 = (c01 >> (8 * i)) & 0xFF, v11 = (c11 >> (8 * i)) & 0xFF;
+        float top = v00 + (v10 - v00) * ax;
+        float bottom = v01 + (v11 - v01) * ax;
+        out[i] = top + (bottom - top) * ay;
+    }
+}
+
+std::uint32_t Texture::sample2D(const TexCoord &tc, TextureFilter filter) const
+{
+    if (filter == TextureFilter::NEAREST || levels.empty())
+        return sample2D(tc.uv.x, tc.uv.y);
+    // outside of [0, 1] stays black, the same as with the nearest sampler
+    if (!(tc.uv.x >= 0 && tc.uv.x <= 1 && tc.uv.y >= 0 && tc.uv.y <= 1))
+        return 0;
+
+    const int max_level = levels.size() - 1;
+    float l = std::clamp(lod(tc), 0.0f, float(max_level));
+    float c[4];
+    if (filter == TextureFilter::BILINEAR)
+    {
+        bilinear(levels[std::lround(l)], tc.uv, c);
+    }
+    else
+    {
+        int l0 = int(l), l1 = std::min(l0 + 1, max_level);
+        float t = l - l0, c1[4];
+        bilinear(levels[l0], tc.uv, c);
+        bilinear(levels[l1], tc.uv, c1);
+        for (int i = 0; i < 4; i++)
+            c[i] += (c1[i] - c[i]) * t;
+    }
+    std::uint32_t ret = 0;
+    for (int i = 0; i < 4; i++)
+        ret |= std::uint32_t(c[i] + 0.5f) << (8 * i);
+    return ret;
+}
+
+vec3f Texture::bilinearNormal(const Level &level, const vec2 &uv) const
+{
+    float x = uv.x * level.w - 0.5f, y = uv.y * level.h - 0.5f;
+    float fx = std::floor(x), fy = std::floor(y);
+    float ax = x - fx, ay = y - fy;
+    int x0 = std::clamp(int(fx), 0, level.w - 1), x1 = std::clamp(int(fx) + 1, 0, level.w - 1);
+    int y0 = std::clamp(int(fy), 0, level.h - 1), y1 = std::clamp(int(fy) + 1, 0, level.h - 1);
+    vec3f top = normals[address(level, x0, y0)] * (1 - ax) + normals[address(level, x1, y0)] * ax;
+    vec3f bottom = normals[address(level, x0, y1)] * (1 - ax) + normals[address(level, x1, y1)] * ax;
+    return top * (1 - ay) + bottom * ay;
+}
+
+vec3 Texture::sampleNormal(const TexCoord &tc, TextureFilter filter) const
+{
+    if (normals.empty())
+        return {0, 0, 1};
+    vec3f n;
+    if (filter == TextureFilter::NEAREST)
+    {
+        // 已经归一化过，直接返回
+        n = fetchNormal(std::clamp(int(w * float(tc.uv.x)), 0, w - 1), std::clamp(int(h * float(tc.uv.y)), 0, h - 1));
+        return {n.x, n.y, n.z};
+    }
+
+    const int max_level = levels.size() - 1;
+    float l = std::clamp(lod(tc), 0.0f, float(max_level));
+    if (filter == TextureFilter::BILINEAR)
+    {
+        n = bilinearNormal(levels[std::lround(l)], tc.uv);
+    }
+    else
+    {
+        int l0 = int(l), l1 = std::min(l0 + 1, max_level);
+        float t = l - l0;
+        n = bilinearNormal(levels[l0], tc.uv) * (1 - t) + bilinearNormal(levels[l1], tc.uv) * t;
+    }
+    n = normalizedOrZ(n);
+    return {n.x, n.y, n.z};
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "tgaimage.h"
+
+// order of the texels of a Texture in memory
+enum class TextureLayout
+{
+    // row-major, the same as TGAImage
+    LINEAR,
+    // 32x32 texel tiles in row-major order, Z-order (Morton) inside a tile
+    // texels that are close in uv are close in memory whatever the direction the surface is sampled in
+    MORTON
+};
+
+enum class TextureFormat
+{
+    // packed 8 bit bgra
+    COLOR,
+    // normal map, decoded once to unit float vectors
+    NORMAL
+};
+
+enum class TextureFilter
+{
+    // nearest texel of the full resolution level
+    NEAREST,
+    // bilinear on the nearest mip level
+    BILINEAR,
+    // bilinear on the two nearest mip levels, blended
+    TRILINEAR
+};
+
+// uv of a fragment and its screen-space derivatives, the derivatives select the mip level
+struct TexCoord
+{
+    vec2 uv;
+    vec2 dx = {0, 0};
+    vec2 dy = {0, 0};
+};
+
+// read-only texture built once from a TGAImage when a mesh is loaded, the fragment stage only samples these
+// COLOR texels are expanded to a packed 32 bit bgra word whatever the bpp of the image, missing channels are 0
+// the mip chain is generated with a 2x2 box filter down to 1x1, NORMAL levels are renormalized
+class Texture
+{
+public:
+    static constexpr int TILE_BITS = 5;
+    static constexpr int TILE_SIZE = 1 << TILE_BITS;
+
+    Texture() = default;
+    Texture(const TGAImage &image, TextureFormat format = TextureFormat::COLOR, TextureLayout layout = TextureLayout::MORTON);
+    // NORMAL texture from row-major unit vectors
+    static Texture fromNormals(int w, int h, const std::vector<vec3f> &normals, TextureLayout layout = TextureLayout::MORTON);
+
+    // level 0 texel without bounds check
+    std::uint32_t fetch(const int x, const int y) const { return data[address(levels[0], x, y)]; }
+
+    // nearest texel, zero outside of the texture like TGAImage::sample2D
+    std::uint32_t sample2D(const float &u, const float &v) const
+    {
+        int x = w * u, y = h * v;
+        if (x < 0 || y < 0 || x >= w || y >= h)
+            return 0;
+        return fetch(x, y);
+    }
+    std::uint32_t sample2D(const TexCoord &tc, TextureFilter filter) const;
+
+    // NORMAL textures: level 0 vector without bounds check, and a sampler returning unit vectors
+    // uv outside of [0, 1] is clamped to the edge
+    vec3f fetchNormal(const int x, const int y) const { return normals[address(levels[0], x, y)]; }
+    vec3 sampleNormal(const TexCoord &tc, TextureFilter filter) const;
+
+    // true if the level 0 texels are exactly what this texture's format makes of image
+    bool matches(const TGAImage &image) const;
+    // bytes held by the texels of all levels
+    std::size_t memoryUsage() const { return data.size() * sizeof(data[0]) + normals.size() * sizeof(normals[0]); }
+
+    // log2 of the number of texels covered by one pixel along its longer axis
+    float lod(const TexCoord &tc) const;
+
+    int width() const { return w; }
+    int height() const { return h; }
+    int levelCount() const { return levels.size(); }
+    TextureFormat getFormat() const { return format; }
+    TextureLayout getLayout() const { return layout; }
+
+private:
+    struct Level
+    {
+        int w, h;
+        int tiles_x;
+        // first texel of the level in data
+        std::size_t offset;
+    };
+
+    // spreads the low 5 bits of v to the even bits
+    static std::size_t spreadBits(std::size_t v)
+    {
+        v = (v | (v << 4)) & 0x30F;
+        v = (v | (v << 2)) & 0x333;
+        v = (v | (v << 1)) & 0x555;
+        return v;
+    }
+
+    // index of texel (x, y) of a level in data
+    std::size_t address(const Level &level, const int x, const int y) const
+    {
+        if (layout == TextureLayout::LINEAR)
+            return level.offset + x + std::size_t(y) * level.w;
+        std::size_t tile = (x >> TILE_BITS) + std::size_t(y >> TILE_BITS) * level.tiles_x;
+        return level.offset + (tile << (2 * TILE_BITS) | spreadBits(x & (TILE_SIZE - 1)) | spreadBits(y & (TILE_SIZE - 1)) << 1);
+    }
+
+    std::size_t texelCount(const Level &level) const;
+    // sets up the levels of a w x h texture, returns the number of texels of the whole chain
+    std::size_t allocate();
+    // bilinear filtered texel of a level, texel centers are at (i + 0.5) / size, edges are clamped
+    void bilinear(const Level &level, const vec2 &uv, float *out) const;
+    vec3f bilinearNormal(const Level &level, const vec2 &uv) const;
+    void buildNormalMips();
+
+    int w = 0;
+    int h = 0;
+    TextureFormat format = TextureFormat::COLOR;
+    TextureLayout layout = TextureLayout::LINEAR;
+    std::vector<Level> levels;
+    std::vector<std::uint32_t> data;
+    std::vector<vec3f> normals;
+};
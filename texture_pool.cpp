@@ -0,0 +1,128 @@
+#include "texture_pool.h"
+#include <iostream>
+
+// FNV-1a over the size and the pixels
+static std::uint64_t hashImage(const TGAImage &image)
+{
+    std::uint64_t h = 14695981039346656037ull;
+    auto add = [&](std::uint8_t byte)
+    {
+        h = (h ^ byte) * 1099511628211ull;
+    };
+    const int header[3] = {image.width(), image.height(), image.bytespp()};
+    for (int v : header)
+    {
+        for (int i = 0; i < 4; i++)
+            add(std::uint8_t(v >> (8 * i)));
+    }
+    const std::size_t row_bytes = std::size_t(image.width()) * image.bytespp();
+    for (int y = 0; y < image.height(); y++)
+    {
+        const std::uint8_t *p = image.row(y);
+        for (std::size_t i = 0; i < row_bytes; i++)
+            add(p[i]);
+    }
+    return h;
+}
+
+template <typename Map>
+static void pruneExpired(Map &map)
+{
+    for (auto it = map.begin(); it != map.end();)
+        it = it->second.expired() ? map.erase(it) : std::next(it);
+}
+
+TexturePool &TexturePool::instance()
+{
+    static TexturePool pool;
+    return pool;
+}
+
+TextureHandle TexturePool::load(const std::string &path, TextureFormat format)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_path.find({path, format});
+        if (it != by_path.end())
+        {
+            if (TextureHandle texture = it->second.lock())
+            {
+                counters.path_hits++;
+                return texture;
+            }
+        }
+    }
+
+    // 读文件和建mip链都在锁外，同时加载同一张图时后插入的一方会拿到先插入的那份
+    TGAImage image;
+    std::cerr << "texture file " << path << " loading ";
+    bool ok = image.read_tga_file(path);
+    std::cerr << (ok ? "ok" : "failed") << std::endl;
+    if (!ok)
+        return std::make_shared<const Texture>();
+    return get(image, format, &path);
+}
+
+TextureHandle TexturePool::get(const TGAImage &image, TextureFormat format)
+{
+    return get(image, format, nullptr);
+}
+
+TextureHandle TexturePool::get(const TGAImage &image, TextureFormat format, const std::string *path)
+{
+    const auto hash_key = std::make_pair(hashImage(image), format);
+    TextureHandle texture;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_hash.find(hash_key);
+        if (it != by_hash.end())
+            texture = it->second.lock();
+    }
+    // the hash only picks the candidate, the texels decide
+    if (texture && texture->matches(image))
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.content_hits++;
+        if (path)
+            by_path[{*path, format}] = texture;
+        return texture;
+    }
+
+    TextureHandle built = std::make_shared<const Texture>(image, format);
+    std::lock_guard<std::mutex> lock(mutex);
+    pruneExpired(by_path);
+    pruneExpired(by_hash);
+    auto &entry = by_hash[hash_key];
+    TextureHandle existing = entry.lock();
+    if (existing && existing->matches(image))
+    {
+        built = existing;
+    }
+    else
+    {
+        entry = built;
+        counters.builds++;
+    }
+    if (path)
+        by_path[{*path, format}] = built;
+    return built;
+}
+
+TexturePoolStats TexturePool::stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    pruneExpired(by_path);
+    pruneExpired(by_hash);
+    TexturePoolStats ret = counters;
+    ret.textures = 0;
+    ret.bytes = 0;
+    for (auto &[key, entry] : by_hash)
+    {
+        if (TextureHandle texture = entry.lock())
+        {
+            ret.textures++;
+            ret.bytes += texture->memoryUsage();
+        }
+    }
+    return ret;
+}
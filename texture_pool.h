@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "texture.h"
+
+// textures are immutable once built, so every mesh using the same image can share one
+using TextureHandle = std::shared_ptr<const Texture>;
+
+struct TexturePoolStats
+{
+    // textures alive, and the bytes held by their texels (all mip levels)
+    int textures = 0;
+    std::size_t bytes = 0;
+    // requests answered by path, requests answered by content after decoding the file, textures built
+    long long path_hits = 0;
+    long long content_hits = 0;
+    long long builds = 0;
+};
+
+// process-wide registry of textures keyed by file path and by content hash
+// entries are weak: a texture is freed when the last handle to it goes away, and built again on the next request
+class TexturePool
+{
+public:
+    static TexturePool &instance();
+
+    // texture of a tga file, shared with earlier requests for the same path and format or for a file with the same contents
+    // returns an empty texture (width 0) if the file can't be read
+    TextureHandle load(const std::string &path, TextureFormat format = TextureFormat::COLOR);
+    // texture of an image in memory, shared with any live texture of the same contents and format
+    TextureHandle get(const TGAImage &image, TextureFormat format = TextureFormat::COLOR);
+
+    TexturePoolStats stats();
+
+private:
+    TexturePool() = default;
+    TextureHandle get(const TGAImage &image, TextureFormat format, const std::string *path);
+
+    std::mutex mutex;
+    std::map<std::pair<std::string, TextureFormat>, std::weak_ptr<const Texture>> by_path;
+    std::map<std::pair<std::uint64_t, TextureFormat>, std::weak_ptr<const Texture>> by_hash;
+    TexturePoolStats counters;
+};
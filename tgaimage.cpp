@@ -2,48 +2,97 @@
 
 #include <cstring>
 #include <iostream>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// whole file mapped read-only, read into memory where mmap is not available
+static std::shared_ptr<const std::uint8_t> mapFile(const std::string &filename, std::size_t &size)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return nullptr;
+    size = st.st_size;
+    const std::size_t length = size;
+    return std::shared_ptr<const std::uint8_t>(static_cast<const std::uint8_t *>(p), [length](const std::uint8_t *q)
+                                               { munmap(const_cast<std::uint8_t *>(q), length); });
+#else
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in.is_open())
+        return nullptr;
+    size = in.tellg();
+    std::shared_ptr<std::uint8_t> buf(new std::uint8_t[size], std::default_delete<std::uint8_t[]>());
+    in.seekg(0);
+    in.read(reinterpret_cast<char *>(buf.get()), size);
+    if (!in.good())
+        return nullptr;
+    return buf;
+#endif
+}
 
 TGAImage::TGAImage(const int w, const int h, const int bpp)
-    : w(w), h(h), bpp(bpp), data(w * h * bpp, 0) {}
+    : w(w), h(h), bpp(bpp), data(w * h * bpp, 0), stride(w * bpp) {}
 
 bool TGAImage::read_tga_file(const std::string filename)
 {
-    std::ifstream in;
-    in.open(filename, std::ios::binary);
-    if (!in.is_open())
+    std::size_t size = 0;
+    std::shared_ptr<const std::uint8_t> file = mapFile(filename, size);
+    if (!file)
     {
         std::cerr << "can't open file " << filename << "\n";
         return false;
     }
     TGAHeader header;
-    in.read(reinterpret_cast<char *>(&header), sizeof(header));
-    if (!in.good())
+    if (size < sizeof(header))
     {
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
-    w = header.width;
-    h = header.height;
-    bpp = header.bitsperpixel >> 3;
-    if (w <= 0 || h <= 0 || (bpp != GRAYSCALE && bpp != RGB && bpp != RGBA))
+    std::memcpy(&header, file.get(), sizeof(header));
+    const int nw = header.width, nh = header.height, nbpp = header.bitsperpixel >> 3;
+    if (nw <= 0 || nh <= 0 || (nbpp != GRAYSCALE && nbpp != RGB && nbpp != RGBA))
     {
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
-    size_t nbytes = bpp * w * h;
-    data = std::vector<std::uint8_t>(nbytes, 0);
+    // the pixels follow the image id and the color map, if any
+    const std::uint8_t *in = file.get() + sizeof(header) + header.idlength;
+    if (header.colormaptype)
+        in += header.colormaplength * ((header.colormapdepth + 7) >> 3);
+    const std::uint8_t *end = file.get() + size;
+    size_t nbytes = size_t(nbpp) * nw * nh;
+    // decoded into a new image, a failed read leaves this one as it was
+    TGAImage img;
     if (3 == header.datatypecode || 2 == header.datatypecode)
     {
-        in.read(reinterpret_cast<char *>(data.data()), nbytes);
-        if (!in.good())
+        if (in > end || size_t(end - in) < nbytes)
         {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        // used in place
+        img.w = nw;
+        img.h = nh;
+        img.bpp = nbpp;
+        img.mapping = file;
+        img.first_row = in - file.get();
+        img.stride = nw * nbpp;
     }
     else if (10 == header.datatypecode || 11 == header.datatypecode)
     {
-        if (!load_rle_data(in))
+        img = TGAImage(nw, nh, nbpp);
+        if (in > end || !img.load_rle_data(in, end))
         {
             std::cerr << "an error occured while reading the data\n";
             return false;
@@ -54,6 +103,7 @@ bool TGAImage::read_tga_file(const std::string filename)
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
+    *this = std::move(img);
     if (!(header.imagedescriptor & 0x20))
         flip_vertically();
     if (header.imagedescriptor & 0x10)
@@ -62,64 +112,128 @@ bool TGAImage::read_tga_file(const std::string filename)
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in)
+// count copies of a bpp byte pixel, written 16 bytes at a time from a pattern of 16 pixels
+static void fillRun(std::uint8_t *dst, const std::uint8_t *pixel, const int bpp, const int count)
+{
+    const int n = count * bpp;
+    if (bpp == 1)
+    {
+        std::memset(dst, pixel[0], n);
+        return;
+    }
+    if (n < 16)
+    {
+        for (int i = 0; i < n; i += bpp)
+            for (int t = 0; t < bpp; t++)
+                dst[i + t] = pixel[t];
+        return;
+    }
+    // 16 pixels are a whole number of 16 byte words
+    const int period = 16 * bpp;
+    std::uint8_t pattern[16 * TGAImage::RGBA];
+    std::memcpy(pattern, pixel, bpp);
+    for (int len = bpp; len < period; len *= 2)
+        std::memcpy(pattern + len, pattern, std::min(len, period - len));
+    int i = 0, offset = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        std::memcpy(dst + i, pattern + offset, 16);
+        offset = offset + 16 == period ? 0 : offset + 16;
+    }
+    std::memcpy(dst + i, pattern + offset, n - i);
+}
+
+bool TGAImage::load_rle_data(const std::uint8_t *&in, const std::uint8_t *end)
 {
     size_t pixelcount = w * h;
-    size_t currentpixel = 0;
     size_t currentbyte = 0;
-    TGAColor colorbuffer;
-    do
+    std::uint8_t *out = data.data();
+    // while a whole packet plus one more 16 byte store fits in both buffers, packets are copied with fixed-size
+    // stores that may run past their end, the excess is overwritten by the packets that follow
+    constexpr size_t slack = 128 * RGBA + 16;
+    while (data.size() - currentbyte >= slack && size_t(end - in) > slack)
+    {
+        const std::uint8_t chunkheader = *in++;
+        std::uint8_t *dst = out + currentbyte;
+        if (chunkheader < 128)
+        {
+            const int n = (chunkheader + 1) * bpp;
+            for (int i = 0; i < n; i += 16)
+                std::memcpy(dst + i, in + i, 16);
+            in += n;
+            currentbyte += n;
+        }
+        else
+        {
+            const int count = chunkheader - 127;
+            if (count >= 16)
+            {
+                fillRun(dst, in, bpp, count);
+            }
+            else if (bpp == 1)
+            {
+                std::uint8_t pattern[16];
+                std::memset(pattern, in[0], 16);
+                std::memcpy(dst, pattern, 16);
+            }
+            else
+            {
+                // one 4 byte store per pixel, a 24 bit pixel spills one byte into the next
+                std::uint32_t pixel;
+                std::memcpy(&pixel, in, 4);
+                for (int i = 0; i < count; i++)
+                    std::memcpy(dst + i * bpp, &pixel, 4);
+            }
+            in += bpp;
+            currentbyte += count * bpp;
+        }
+    }
+    size_t currentpixel = currentbyte / bpp;
+    while (currentpixel < pixelcount)
     {
-        std::uint8_t chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good())
+        if (in >= end)
         {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        std::uint8_t chunkheader = *in++;
         if (chunkheader < 128)
         {
             chunkheader++;
-            for (int i = 0; i < chunkheader; i++)
+            if (size_t(end - in) < size_t(chunkheader) * bpp)
             {
-                in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-                if (!in.good())
-                {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t = 0; t < bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel > pixelcount)
-                {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
+                std::cerr << "an error occured while reading the header\n";
+                return false;
             }
+            if (currentpixel + chunkheader > pixelcount)
+            {
+                std::cerr << "Too many pixels read\n";
+                return false;
+            }
+            std::memcpy(out + currentbyte, in, chunkheader * bpp);
+            in += chunkheader * bpp;
+            currentbyte += chunkheader * bpp;
+            currentpixel += chunkheader;
         }
         else
         {
             chunkheader -= 127;
-            in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-            if (!in.good())
+            if (size_t(end - in) < bpp)
             {
                 std::cerr << "an error occured while reading the header\n";
                 return false;
             }
-            for (int i = 0; i < chunkheader; i++)
+            if (currentpixel + chunkheader > pixelcount)
             {
-                for (int t = 0; t < bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel > pixelcount)
-                {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
+                std::cerr << "Too many pixels read\n";
+                return false;
             }
+            fillRun(out + currentbyte, in, bpp, chunkheader);
+            in += bpp;
+            currentbyte += chunkheader * bpp;
+            currentpixel += chunkheader;
         }
-    } while (currentpixel < pixelcount);
+    }
     return true;
 }
 
@@ -144,105 +258,368 @@ bool TGAImage::write_tga_file(const std::string filename,
     header.width = w;
     header.height = h;
     header.datatypecode = (bpp == GRAYSCALE ? (rle ? 11 : 3) : (rle ? 10 : 2));
+    // rows are written in memory order, from the lowest address, and the origin bit says which end that is
+    const std::uint8_t *pixels = stride > 0 ? row(0) : row(h - 1);
     header.imagedescriptor =
-        vflip ? 0x00 : 0x20; // top-left or bottom-left origin
-    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        vflip == (stride > 0) ? 0x00 : 0x20; // top-left or bottom-left origin
+    // the whole file is assembled in memory and written at once
+    std::vector<std::uint8_t> file(reinterpret_cast<const std::uint8_t *>(&header),
+                                   reinterpret_cast<const std::uint8_t *>(&header) + sizeof(header));
+    if (!rle)
+        file.insert(file.end(), pixels, pixels + std::size_t(w) * h * bpp);
+    else
+        unload_rle_data(pixels, file);
+    file.insert(file.end(), developer_area_ref, developer_area_ref + sizeof(developer_area_ref));
+    file.insert(file.end(), extension_area_ref, extension_area_ref + sizeof(extension_area_ref));
+    file.insert(file.end(), footer, footer + sizeof(footer));
+    out.write(reinterpret_cast<const char *>(file.data()), file.size());
     if (!out.good())
     {
         std::cerr << "can't dump the tga file\n";
         return false;
     }
-    if (!rle)
+    return true;
+}
+
+// pixel as an integer, so that runs are found with one compare per pixel
+static inline std::uint32_t loadPixel(const std::uint8_t *p, const int bpp)
+{
+    if (bpp == 1)
+        return p[0];
+    if (bpp == 3)
+        return p[0] | p[1] << 8 | std::uint32_t(p[2]) << 16;
+    std::uint32_t ret;
+    std::memcpy(&ret, p, 4);
+    return ret;
+}
+
+// packets of npixels pixels written to out, returns the end of the written bytes
+// out must have room for npixels * (bpp + 1) bytes
+// TODO: it is not necessary to break a raw chunk for two equal pixels (for the
+// matter of the resulting size)
+static std::uint8_t *encodeRLE(const std::uint8_t *pixels, const std::size_t npixels, const int bpp, std::uint8_t *out)
+{
+    const std::size_t max_chunk_length = 128;
+    size_t curpix = 0;
+    while (curpix < npixels)
     {
-        out.write(reinterpret_cast<const char *>(data.data()), w * h * bpp);
-        if (!out.good())
+        const std::uint8_t *p = pixels + curpix * bpp;
+        const std::size_t max_length = std::min(max_chunk_length, npixels - curpix);
+        std::uint32_t prev = loadPixel(p, bpp);
+        std::size_t run_length = 1;
+        if (max_length > 1 && loadPixel(p + bpp, bpp) == prev)
         {
-            std::cerr << "can't unload raw data\n";
-            return false;
+            // run of equal pixels
+            run_length = 2;
+            while (run_length < max_length && loadPixel(p + run_length * bpp, bpp) == prev)
+                run_length++;
+            *out++ = run_length + 127;
+            std::memcpy(out, p, bpp);
+            out += bpp;
+        }
+        else
+        {
+            // raw pixels up to the first pair of equal ones
+            run_length = max_length;
+            for (std::size_t i = 1; i < max_length; i++)
+            {
+                const std::uint32_t next = loadPixel(p + i * bpp, bpp);
+                if (next == prev)
+                {
+                    run_length = i - 1;
+                    break;
+                }
+                prev = next;
+            }
+            *out++ = run_length - 1;
+            std::memcpy(out, p, run_length * bpp);
+            out += run_length * bpp;
         }
+        curpix += run_length;
     }
-    else if (!unload_rle_data(out))
+    return out;
+}
+
+// strips of rows are encoded independently, so packets never cross a strip boundary
+// the strip height is fixed, the file does not depend on the number of threads
+void TGAImage::unload_rle_data(const std::uint8_t *pixels, std::vector<std::uint8_t> &out) const
+{
+    constexpr int strip_rows = 16;
+    const int strips = (h + strip_rows - 1) / strip_rows;
+    const std::size_t strip_pixels = std::size_t(w) * strip_rows;
+    // every strip is encoded at its worst-case offset, then the strips are moved down to close the gaps
+    const std::size_t strip_capacity = strip_pixels * (bpp + 1);
+    const std::size_t begin = out.size();
+    std::vector<std::size_t> sizes(strips);
+    out.resize(begin + strip_capacity * strips);
+#pragma omp parallel for schedule(dynamic)
+    for (int s = 0; s < strips; s++)
     {
-        std::cerr << "can't unload rle data\n";
-        return false;
+        const std::size_t npixels = std::size_t(w) * std::min(strip_rows, h - s * strip_rows);
+        std::uint8_t *dst = out.data() + begin + s * strip_capacity;
+        sizes[s] = encodeRLE(pixels + s * strip_pixels * bpp, npixels, bpp, dst) - dst;
     }
-    out.write(reinterpret_cast<const char *>(developer_area_ref),
-              sizeof(developer_area_ref));
-    if (!out.good())
+    std::size_t end = begin;
+    for (int s = 0; s < strips; s++)
     {
-        std::cerr << "can't dump the tga file\n";
-        return false;
+        std::memmove(out.data() + end, out.data() + begin + s * strip_capacity, sizes[s]);
+        end += sizes[s];
     }
-    out.write(reinterpret_cast<const char *>(extension_area_ref),
-              sizeof(extension_area_ref));
-    if (!out.good())
+    out.resize(end);
+}
+
+// QOI chunk tags, 2 bit tags use the high bits of the byte
+constexpr std::uint8_t QOI_OP_INDEX = 0x00;
+constexpr std::uint8_t QOI_OP_DIFF = 0x40;
+constexpr std::uint8_t QOI_OP_LUMA = 0x80;
+constexpr std::uint8_t QOI_OP_RUN = 0xC0;
+constexpr std::uint8_t QOI_OP_RGB = 0xFE;
+constexpr std::uint8_t QOI_OP_RGBA = 0xFF;
+constexpr std::size_t QOI_HEADER_SIZE = 14;
+constexpr std::uint8_t qoi_padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+// pixels are handled as rgba packed into one word, r in the low byte
+static inline int qoiHash(const std::uint32_t px)
+{
+    return ((px & 0xFF) * 3 + (px >> 8 & 0xFF) * 5 + (px >> 16 & 0xFF) * 7 + (px >> 24) * 11) & 63;
+}
+
+// state of a QOI encoder carried from one row to the next
+struct QoiEncoder
+{
+    std::uint32_t index[64] = {};
+    std::uint32_t prev = 0xFF000000;
+    int run = 0;
+    std::uint8_t *out;
+};
+
+// pixel loop specialized per bpp, so the pixel load has no branch
+template <int BPP>
+static void encodeQoiRow(const std::uint8_t *p, const int w, QoiEncoder &enc)
+{
+    std::uint8_t *o = enc.out;
+    std::uint32_t prev = enc.prev;
+    int run = enc.run;
+    for (int i = 0; i < w; i++, p += BPP)
     {
-        std::cerr << "can't dump the tga file\n";
+        std::uint32_t px;
+        if constexpr (BPP == TGAImage::GRAYSCALE)
+            px = p[0] * 0x010101u | 0xFF000000;
+        else if constexpr (BPP == TGAImage::RGB)
+            px = p[2] | p[1] << 8 | p[0] << 16 | 0xFF000000;
+        else
+            px = p[2] | p[1] << 8 | p[0] << 16 | std::uint32_t(p[3]) << 24;
+        if (px == prev)
+        {
+            if (++run == 62)
+            {
+                *o++ = QOI_OP_RUN | 61;
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0)
+        {
+            *o++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+        const int slot = qoiHash(px);
+        if (enc.index[slot] == px)
+        {
+            *o++ = QOI_OP_INDEX | slot;
+        }
+        else
+        {
+            enc.index[slot] = px;
+            if ((px ^ prev) >> 24 == 0)
+            {
+                // channel differences, biased so that each range test is a single unsigned compare
+                const std::uint8_t vr = px - prev;
+                const std::uint8_t vg = (px >> 8) - (prev >> 8);
+                const std::uint8_t vb = (px >> 16) - (prev >> 16);
+                const std::uint8_t dr = vr + 2, dg = vg + 2, db = vb + 2;
+                const std::uint8_t lr = vr - vg + 8, lg = vg + 32, lb = vb - vg + 8;
+                if ((dr | dg | db) < 4)
+                {
+                    *o++ = QOI_OP_DIFF | dr << 4 | dg << 2 | db;
+                }
+                else if ((lr | lb) < 16 && lg < 64)
+                {
+                    *o++ = QOI_OP_LUMA | lg;
+                    *o++ = lr << 4 | lb;
+                }
+                else
+                {
+                    *o++ = QOI_OP_RGB;
+                    *o++ = px;
+                    *o++ = px >> 8;
+                    *o++ = px >> 16;
+                }
+            }
+            else
+            {
+                *o++ = QOI_OP_RGBA;
+                for (int k = 0; k < 32; k += 8)
+                    *o++ = px >> k;
+            }
+        }
+        prev = px;
+    }
+    enc.out = o;
+    enc.prev = prev;
+    enc.run = run;
+}
+
+bool TGAImage::write_qoi_file(const std::string filename, const bool vflip) const
+{
+    std::ofstream out;
+    out.open(filename, std::ios::binary);
+    if (!out.is_open())
+    {
+        std::cerr << "can't open file " << filename << "\n";
         return false;
     }
-    out.write(reinterpret_cast<const char *>(footer), sizeof(footer));
+    const int channels = bpp == RGBA ? 4 : 3;
+    // worst case is one QOI_OP_RGBA chunk per pixel, left uninitialized as only the written part is touched
+    std::unique_ptr<std::uint8_t[]> file(new std::uint8_t[QOI_HEADER_SIZE + std::size_t(w) * h * 5 + sizeof(qoi_padding)]);
+    std::uint8_t *o = file.get();
+    auto put32 = [&](const std::uint32_t v)
+    {
+        for (int i = 24; i >= 0; i -= 8)
+            *o++ = v >> i;
+    };
+    std::memcpy(o, "qoif", 4);
+    o += 4;
+    put32(w);
+    put32(h);
+    *o++ = channels;
+    *o++ = 0; // sRGB with linear alpha
+    QoiEncoder enc;
+    enc.out = o;
+    // QOI rows are top-down, vflip puts row 0 at the bottom like write_tga_file
+    for (int j = 0; j < h; j++)
+    {
+        const std::uint8_t *p = row(vflip ? h - 1 - j : j);
+        if (bpp == GRAYSCALE)
+            encodeQoiRow<GRAYSCALE>(p, w, enc);
+        else if (bpp == RGB)
+            encodeQoiRow<RGB>(p, w, enc);
+        else
+            encodeQoiRow<RGBA>(p, w, enc);
+    }
+    o = enc.out;
+    if (enc.run > 0)
+        *o++ = QOI_OP_RUN | (enc.run - 1);
+    std::memcpy(o, qoi_padding, sizeof(qoi_padding));
+    o += sizeof(qoi_padding);
+    out.write(reinterpret_cast<const char *>(file.get()), o - file.get());
     if (!out.good())
     {
-        std::cerr << "can't dump the tga file\n";
+        std::cerr << "can't dump the qoi file\n";
         return false;
     }
     return true;
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the
-// matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) const
+bool TGAImage::read_qoi_file(const std::string filename)
 {
-    const std::uint8_t max_chunk_length = 128;
-    size_t npixels = w * h;
-    size_t curpix = 0;
-    while (curpix < npixels)
+    std::size_t size = 0;
+    std::shared_ptr<const std::uint8_t> file = mapFile(filename, size);
+    if (!file)
     {
-        size_t chunkstart = curpix * bpp;
-        size_t curbyte = curpix * bpp;
-        std::uint8_t run_length = 1;
-        bool raw = true;
-        while (curpix + run_length < npixels && run_length < max_chunk_length)
-        {
-            bool succ_eq = true;
-            for (int t = 0; succ_eq && t < bpp; t++)
-                succ_eq = (data[curbyte + t] == data[curbyte + t + bpp]);
-            curbyte += bpp;
-            if (1 == run_length)
-                raw = !succ_eq;
-            if (raw && succ_eq)
-            {
-                run_length--;
-                break;
-            }
-            if (!raw && !succ_eq)
-                break;
-            run_length++;
-        }
-        curpix += run_length;
-        out.put(raw ? run_length - 1 : run_length + 127);
-        if (!out.good())
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    const std::uint8_t *in = file.get();
+    if (size < QOI_HEADER_SIZE + sizeof(qoi_padding) || std::memcmp(in, "qoif", 4) != 0)
+    {
+        std::cerr << "an error occured while reading the header\n";
+        return false;
+    }
+    auto get32 = [](const std::uint8_t *p)
+    { return std::uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3]; };
+    const std::uint32_t qw = get32(in + 4), qh = get32(in + 8);
+    const int channels = in[12];
+    // the pixel count limit of the QOI spec
+    if (qw == 0 || qh == 0 || qh >= 400000000u / qw || (channels != RGB && channels != RGBA))
+    {
+        std::cerr << "bad channels (or width/height) value\n";
+        return false;
+    }
+    w = qw;
+    h = qh;
+    bpp = channels;
+    mapping.reset();
+    data = std::vector<std::uint8_t>(std::size_t(w) * h * bpp);
+    first_row = 0;
+    stride = w * bpp;
+    // the padding guarantees every chunk started before it is complete
+    const std::uint8_t *end = file.get() + size - sizeof(qoi_padding);
+    in += QOI_HEADER_SIZE;
+    std::uint32_t index[64] = {};
+    std::uint32_t px = 0xFF000000;
+    int run = 0;
+    for (std::uint8_t *o = data.data(), *last = o + data.size(); o < last; o += bpp)
+    {
+        if (run > 0)
         {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+            run--;
         }
-        out.write(reinterpret_cast<const char *>(data.data() + chunkstart),
-                  (raw ? run_length * bpp : bpp));
-        if (!out.good())
+        else if (in < end)
         {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+            const std::uint8_t b1 = *in++;
+            if (b1 == QOI_OP_RGB)
+            {
+                px = (px & 0xFF000000) | in[0] | in[1] << 8 | in[2] << 16;
+                in += 3;
+            }
+            else if (b1 == QOI_OP_RGBA)
+            {
+                px = in[0] | in[1] << 8 | in[2] << 16 | std::uint32_t(in[3]) << 24;
+                in += 4;
+            }
+            else if ((b1 & 0xC0) == QOI_OP_INDEX)
+            {
+                px = index[b1];
+            }
+            else if ((b1 & 0xC0) == QOI_OP_DIFF)
+            {
+                const std::uint8_t r = px + ((b1 >> 4 & 3) - 2);
+                const std::uint8_t g = (px >> 8) + ((b1 >> 2 & 3) - 2);
+                const std::uint8_t b = (px >> 16) + ((b1 & 3) - 2);
+                px = (px & 0xFF000000) | r | g << 8 | b << 16;
+            }
+            else if ((b1 & 0xC0) == QOI_OP_LUMA)
+            {
+                const std::uint8_t b2 = *in++;
+                const int vg = (b1 & 0x3F) - 32;
+                const std::uint8_t r = px + (vg - 8 + (b2 >> 4 & 0x0F));
+                const std::uint8_t g = (px >> 8) + vg;
+                const std::uint8_t b = (px >> 16) + (vg - 8 + (b2 & 0x0F));
+                px = (px & 0xFF000000) | r | g << 8 | b << 16;
+            }
+            else
+            {
+                run = b1 & 0x3F;
+            }
+            index[qoiHash(px)] = px;
         }
+        o[0] = px >> 16;
+        o[1] = px >> 8;
+        o[2] = px;
+        if (bpp == RGBA)
+            o[3] = px >> 24;
     }
+    std::cerr << w << "x" << h << "/" << bpp * 8 << "\n";
     return true;
 }
 
 TGAColor TGAImage::get(const int x, const int y) const
 {
-    if (!data.size() || x < 0 || y < 0 || x >= w || y >= h)
+    if (x < 0 || y < 0 || x >= w || y >= h)
         return {};
     TGAColor ret = {0, 0, 0, 0, bpp};
-    const std::uint8_t *p = data.data() + (x + y * w) * bpp;
+    const std::uint8_t *p = row(y) + x * bpp;
     for (int i = bpp; i--; ret.bgra[i] = p[i])
         ;
     return ret;
@@ -250,9 +627,11 @@ TGAColor TGAImage::get(const int x, const int y) const
 
 void TGAImage::set(int x, int y, const TGAColor &c)
 {
-    if (!data.size() || x < 0 || y < 0 || x >= w || y >= h)
+    if (x < 0 || y < 0 || x >= w || y >= h)
         return;
-    memcpy(data.data() + (x + y * w) * bpp, c.bgra, bpp);
+    if (mapping)
+        detach();
+    memcpy(data.data() + first_row + y * stride + x * bpp, c.bgra, bpp);
 }
 
 void TGAImage::set(const vec2 &point, const TGAColor &c)
@@ -260,24 +639,35 @@ void TGAImage::set(const vec2 &point, const TGAColor &c)
     set(point.x, point.y, c);
 }
 
+void TGAImage::detach()
+{
+    const std::size_t row_bytes = std::size_t(w) * bpp;
+    std::vector<std::uint8_t> copy(row_bytes * h);
+    for (int j = 0; j < h; j++)
+        memcpy(copy.data() + j * row_bytes, base() + first_row + j * stride, row_bytes);
+    data = std::move(copy);
+    mapping.reset();
+    first_row = 0;
+    stride = row_bytes;
+}
+
 void TGAImage::flip_horizontally()
 {
-    int half = w >> 1;
-    for (int i = 0; i < half; i++)
-        for (int j = 0; j < h; j++)
-            for (int b = 0; b < bpp; b++)
-                std::swap(data[(i + j * w) * bpp + b],
-                          data[(w - 1 - i + j * w) * bpp + b]);
+    if (mapping)
+        detach();
+    for (int j = 0; j < h; j++)
+    {
+        std::uint8_t *p = data.data() + first_row + j * stride;
+        for (int i = 0, k = w - 1; i < k; i++, k--)
+            std::swap_ranges(p + i * bpp, p + (i + 1) * bpp, p + k * bpp);
+    }
 }
 
 void TGAImage::flip_vertically()
 {
-    int half = h >> 1;
-    for (int i = 0; i < w; i++)
-        for (int j = 0; j < half; j++)
-            for (int b = 0; b < bpp; b++)
-                std::swap(data[(i + j * w) * bpp + b],
-                          data[(i + (h - 1 - j) * w) * bpp + b]);
+    if (h > 0)
+        first_row += (h - 1) * stride;
+    stride = -stride;
 }
 
 int TGAImage::width() const
@@ -290,15 +680,23 @@ int TGAImage::height() const
     return h;
 }
 
+int TGAImage::bytespp() const
+{
+    return bpp;
+}
+
 void TGAImage::clear(const TGAColor &color)
 {
-    for (int i = 0; i < w; i++)
+    if (mapping)
     {
-        for (int j = 0; j < h; j++)
-        {
-            set(i, j, color);
-        }
+        mapping.reset();
+        data.assign(std::size_t(w) * h * bpp, 0);
+        first_row = 0;
+        stride = w * bpp;
     }
+    // every byte of data is a pixel whatever the row order
+    for (std::size_t i = 0; i < data.size(); i += bpp)
+        memcpy(data.data() + i, color.bgra, bpp);
 }
 
 TGAColor TGAImage::sample2D(const float &u, const float &v) const
@@ -1,6 +1,10 @@
 #pragma once
+#include <algorithm>
 #include <cstdint>
+#include <cstddef>
 #include <fstream>
+#include <memory>
+#include <string>
 #include <vector>
 #include "geometry.h"
 
@@ -50,6 +54,47 @@ struct TGAColor
     }
 };
 
+// 8 bit bgra in one word, the texel and sample format of the renderer
+inline std::uint32_t packColor(const TGAColor &c)
+{
+    return c.bgra[0] | c.bgra[1] << 8 | c.bgra[2] << 16 | std::uint32_t(c.bgra[3]) << 24;
+}
+
+inline TGAColor unpackColor(const std::uint32_t c)
+{
+    return {std::uint8_t(c), std::uint8_t(c >> 8), std::uint8_t(c >> 16), std::uint8_t(c >> 24)};
+}
+
+// vector stored in a normal map texel, (r, g, b) * 2 / 255 - 1
+inline vec3 decodeNormal(const TGAColor &c)
+{
+    return vec3{(real)c.bgra[2], (real)c.bgra[1], (real)c.bgra[0]} * 2. / 255. - vec3{1, 1, 1};
+}
+
+// every channel times k, clamped to [0, 255] and truncated, the same as TGAColor::operator*
+inline std::uint32_t scaleColor(const std::uint32_t c, const double k)
+{
+#ifdef SERIKA_SSE
+    // double lanes, so the result is bit-identical to the scalar version
+    __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(c), _mm_setzero_si128()), _mm_setzero_si128());
+    __m128d vk = _mm_set1_pd(k), lo = _mm_set1_pd(0), hi = _mm_set1_pd(255);
+    __m128d ga = _mm_max_pd(_mm_min_pd(_mm_mul_pd(_mm_cvtepi32_pd(v), vk), hi), lo);
+    __m128d rb = _mm_max_pd(_mm_min_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, 0x0E)), vk), hi), lo);
+    __m128i ret = _mm_unpacklo_epi64(_mm_cvttpd_epi32(ga), _mm_cvttpd_epi32(rb));
+    ret = _mm_packus_epi16(_mm_packs_epi32(ret, ret), ret);
+    return _mm_cvtsi128_si32(ret);
+#else
+    std::uint32_t ret = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        ret |= std::uint32_t(std::max(0.0, std::min(255.0, ((c >> (8 * i)) & 0xFF) * k))) << (8 * i);
+    }
+    return ret;
+#endif
+}
+
+// pixels are addressed through a signed row stride, so bottom-up files and vertical flips need no copy
+// uncompressed files are mapped read-only and used in place, the first write copies them to owned memory
 struct TGAImage
 {
     enum Format
@@ -64,6 +109,10 @@ struct TGAImage
     bool read_tga_file(const std::string filename);
     bool write_tga_file(const std::string filename, const bool vflip = true,
                         const bool rle = true) const;
+    // QOI, lossless and about half the size of rle tga on rendered frames, see https://qoiformat.org
+    // GRAYSCALE images are written as RGB, reading gives RGB or RGBA
+    bool read_qoi_file(const std::string filename);
+    bool write_qoi_file(const std::string filename, const bool vflip = true) const;
     void flip_horizontally();
     void flip_vertically();
     TGAColor get(const int x, const int y) const;
@@ -73,13 +122,34 @@ struct TGAImage
     TGAColor sample2D(const float &u, const float &v) const;
     int width() const;
     int height() const;
+    int bytespp() const;
+    // first pixel of row y, rows are width() * bytespp() bytes
+    const std::uint8_t *row(const int y) const { return base() + first_row + y * stride; }
+    // writable row y, mapped pixels are copied to owned memory first like set() does
+    std::uint8_t *row(const int y)
+    {
+        if (mapping)
+            detach();
+        return data.data() + first_row + y * stride;
+    }
+    // bytes from one row to the next, negative when the rows are stored bottom-up
+    std::ptrdiff_t rowStride() const { return stride; }
 
 private:
-    bool load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out) const;
+    const std::uint8_t *base() const { return mapping ? mapping.get() : data.data(); }
+    // copies mapped pixels to data, top-down, before they are written
+    void detach();
+    bool load_rle_data(const std::uint8_t *&in, const std::uint8_t *end);
+    // appends the rle packets of the w x h pixels to out
+    void unload_rle_data(const std::uint8_t *pixels, std::vector<std::uint8_t> &out) const;
 
     int w = 0;
     int h = 0;
     std::uint8_t bpp = 0;
     std::vector<std::uint8_t> data = {};
+    // whole file mapped read-only, shared by copies of the image
+    std::shared_ptr<const std::uint8_t> mapping;
+    // offset of row 0 from base() and the signed distance between rows
+    std::ptrdiff_t first_row = 0;
+    std::ptrdiff_t stride = 0;
 };